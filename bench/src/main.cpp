@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <string>
+
+#include <storage/SDCardArray.h>
+#include <storage/SDCardAsyncIO.h>
+#include <storage/SDCardAsyncWriter.h>
+#include <storage/SDCardContiguousWriter.h>
+#include <storage/SDCardDirectoryListing.h>
+#include <storage/SDCardImage.h>
+#include <storage/SDCardLineReader.h>
+#include <storage/SDCardMetadataBatch.h>
+#include <storage/SDCardRecordLog.h>
+#include <storage/SDCardSectorCache.h>
+
+// Usage: pico-sd-bench <image> [size_mb] [latency_us] [read_bytes_per_sec] [write_bytes_per_sec]
+// A missing image is created and formatted. Every case prints the wall time on the host,
+// the modelled card time and the block commands FatFs issued for it. The multi-card cases
+// put a second image at <image>.1.
+
+static SDCardImage* card;
+
+template<typename F>
+static void RunCase(const char* name, uint64_t bytes, F&& fn)
+{
+    card->ResetStatistics();
+    auto start = std::chrono::steady_clock::now();
+    fn();
+    auto end = std::chrono::steady_clock::now();
+
+    const SDCardImage::Statistics& stats = card->GetStatistics();
+    double wall_ms = std::chrono::duration<double, std::milli>(end - start).count();
+    double card_ms = stats.busy_us / 1000.0;
+    double mbps = card_ms > 0 ? (bytes / (1024.0 * 1024.0)) / (card_ms / 1000.0) : 0;
+
+    printf("%-24s wall %9.2f ms  card %9.2f ms  %8.2f MiB/s  rd %6llu cmd %8llu sec  wr %6llu cmd %8llu sec  sync %llu  stop %llu\n",
+        name, wall_ms, card_ms, mbps,
+        (unsigned long long)stats.read_commands, (unsigned long long)stats.sectors_read,
+        (unsigned long long)stats.write_commands, (unsigned long long)stats.sectors_written,
+        (unsigned long long)stats.sync_commands, (unsigned long long)stats.stop_commands);
+}
+
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s <image> [size_mb] [latency_us] [read_bytes_per_sec] [write_bytes_per_sec]\n", argv[0]);
+        return 1;
+    }
+
+    uint64_t size_mb = argc > 2 ? strtoull(argv[2], nullptr, 10) : 64;
+    SDCardImage::Timing timing;
+    timing.command_latency_us = argc > 3 ? strtoul(argv[3], nullptr, 10) : 100;
+    timing.read_bytes_per_sec = argc > 4 ? strtoul(argv[4], nullptr, 10) : 20 * 1000 * 1000;
+    timing.write_bytes_per_sec = argc > 5 ? strtoul(argv[5], nullptr, 10) : 10 * 1000 * 1000;
+
+    static SDCardImage image(argv[1], size_mb * 1024 * 1024);
+    card = &image;
+    card->SetTiming(timing);
+
+    if (!card->Mount())
+    {
+        card->Unmount();
+        if (!card->Format() || !card->Mount())
+        {
+            printf("Could not mount or format %s\n", argv[1]);
+            return 1;
+        }
+    }
+
+    constexpr size_t chunk_size = 4096;
+    constexpr size_t total_size = 4 * 1024 * 1024;
+    static char chunk[chunk_size];
+    for (size_t i = 0; i < chunk_size; i++)
+        chunk[i] = 'a' + (i % 26);
+    chunk[chunk_size - 1] = '\n';
+
+    RunCase("sequential write", total_size, [&]() {
+        card->OpenFile("bench.bin", StorageDevice::WRITE | StorageDevice::CREATE_OVERWRITE);
+        for (size_t written = 0; written < total_size; written += chunk_size)
+            card->WriteBuffer(chunk, chunk_size);
+        card->WriteString("END-MARKER\n");
+        card->CloseFile();
+    });
+
+    RunCase("contiguous write", total_size, [&]() {
+        SDCardContiguousWriter writer(*card);
+        writer.Open("capture.bin", total_size);
+        for (size_t written = 0; written < total_size; written += chunk_size)
+            writer.Write(chunk, chunk_size);
+        writer.Close();
+    });
+
+    RunCase("stream write", total_size, [&]() {
+        static uint8_t write_buffer[FF_MIN_SS * 8];
+        card->SetWriteBuffer(write_buffer, sizeof(write_buffer));
+        card->OpenFile("stream.bin", StorageDevice::WRITE | StorageDevice::CREATE_OVERWRITE);
+        card->BeginStream(total_size);
+        for (size_t written = 0; written < total_size; written += chunk_size)
+            card->WriteBuffer(chunk, chunk_size);
+        card->CloseFile();
+        card->SetWriteBuffer(nullptr, 0);
+    });
+
+    RunCase("sequential read", total_size, [&]() {
+        card->OpenFile("bench.bin", StorageDevice::READ | StorageDevice::OPEN_EXISTING);
+        while (card->ReadBuffer(chunk, chunk_size) == chunk_size);
+        card->CloseFile();
+    });
+
+    RunCase("streamed read", total_size, [&]() {
+        static uint8_t stream_buffer[FF_MIN_SS * 8];
+        static uint32_t checksum;
+        card->OpenFile("bench.bin", StorageDevice::READ | StorageDevice::OPEN_EXISTING);
+        card->StreamFile([](const uint8_t* data, size_t size, uint64_t, void*) {
+            for (size_t i = 0; i < size; i++)
+                checksum += data[i];
+            return true;
+        }, nullptr, stream_buffer, sizeof(stream_buffer));
+        card->CloseFile();
+    });
+
+    RunCase("double-buffered read", total_size, [&]() {
+        static char buffers[2][chunk_size];
+        SDCard::FileHandle handle = card->OpenHandle("bench.bin", StorageDevice::READ | StorageDevice::OPEN_EXISTING);
+        SDCardAsyncIO io(*card);
+        io.Start();
+        uint32_t requests[2] = {io.ReadAsync(handle, buffers[0], chunk_size), io.ReadAsync(handle, buffers[1], chunk_size)};
+        for (int i = 0; io.Wait(requests[i]) > 0; i ^= 1)
+            requests[i] = io.ReadAsync(handle, buffers[i], chunk_size); // the other buffer fills meanwhile
+        io.Stop();
+        card->CloseHandle(handle);
+    });
+
+    RunCase("find next string", total_size, [&]() {
+        card->OpenFile("bench.bin", StorageDevice::READ | StorageDevice::OPEN_EXISTING);
+        card->FindNextString("END-MARKER");
+        card->CloseFile();
+    });
+
+    RunCase("find previous string", total_size, [&]() {
+        card->OpenFile("bench.bin", StorageDevice::READ | StorageDevice::OPEN_EXISTING);
+        card->SeekEnd();
+        card->FindPreviousString("END-MARKER");
+        card->CloseFile();
+    });
+
+    constexpr size_t line_count = 10000;
+    RunCase("small line writes", line_count * 32, [&]() {
+        card->OpenFile("telemetry.txt", StorageDevice::WRITE | StorageDevice::CREATE_OVERWRITE);
+        for (size_t i = 0; i < line_count; i++)
+            card->WriteString("t=0000000 a=000 b=000 c=000000\n");
+        card->CloseFile();
+    });
+
+    RunCase("buffered line writes", line_count * 32, [&]() {
+        static uint8_t write_buffer[FF_MIN_SS * 8];
+        card->SetWriteBuffer(write_buffer, sizeof(write_buffer));
+        card->OpenFile("telemetry.txt", StorageDevice::WRITE | StorageDevice::CREATE_OVERWRITE);
+        for (size_t i = 0; i < line_count; i++)
+            card->WriteString("t=0000000 a=000 b=000 c=000000\n");
+        card->CloseFile();
+        card->SetWriteBuffer(nullptr, 0);
+    });
+
+    RunCase("async line writes", line_count * 32, [&]() {
+        static uint8_t ring[64 * 1024];
+        SDCardAsyncWriter writer(*card, ring, sizeof(ring));
+        writer.Open("telemetry-async.txt", StorageDevice::WRITE | StorageDevice::CREATE_OVERWRITE);
+        writer.Start();
+        for (size_t i = 0; i < line_count; i++)
+            writer.Push("t=0000000 a=000 b=000 c=000000\n", 31);
+        writer.Close();
+
+        SDCardAsyncWriter::Statistics stats = writer.GetStatistics();
+        printf("%-24s high water %u B  overflows %u\n", "", stats.high_water, stats.overflows);
+    });
+
+    RunCase("read lines", line_count * 32, [&]() {
+        card->OpenFile("telemetry.txt", StorageDevice::READ | StorageDevice::OPEN_EXISTING);
+        UniqueArray<char> line = make_unique_array_empty<char>(4096);
+        while (card->ReadLine(line) > 0);
+        card->CloseFile();
+    });
+
+    RunCase("line reader", line_count * 32, [&]() {
+        card->OpenFile("telemetry.txt", StorageDevice::READ | StorageDevice::OPEN_EXISTING);
+        SDCardLineReader reader(*card);
+        std::string_view line;
+        while (reader.ReadLine(line));
+        card->CloseFile();
+    });
+
+    RunCase("read last lines", 0, [&]() {
+        card->OpenFile("telemetry.txt", StorageDevice::READ | StorageDevice::OPEN_EXISTING);
+        UniqueArray<char> lines;
+        card->ReadLastLines(lines, 20);
+        card->CloseFile();
+    });
+
+    constexpr size_t record_count = 20000;
+    RunCase("record log append", record_count * 32, [&]() {
+        card->Delete("records.log");
+        card->Delete("records.log.idx");
+        SDCardRecordLog log(*card);
+        log.Open("records.log");
+        for (size_t i = 0; i < record_count; i++)
+            log.Append(i * 10, chunk, 32);
+        log.Close();
+    });
+
+    RunCase("record log seek", 0, [&]() {
+        SDCardRecordLog log(*card);
+        log.Open("records.log");
+        char record[64];
+        uint64_t key;
+        uint16_t length;
+        for (uint64_t at = 0; at < record_count * 10; at += record_count)
+        {
+            log.Seek(at);
+            log.Next(key, record, sizeof(record), length);
+        }
+        log.Close();
+    });
+
+    // log.0 to log.7, the oldest dropped and the rest moved up one, plus a directory per round
+    constexpr int rotation_depth = 8;
+    card->CreateDirectory("logs");
+    for (int i = 0; i < rotation_depth; i++)
+    {
+        char path[32];
+        snprintf(path, sizeof(path), "logs/log.%d", i);
+        card->OpenFile(path, StorageDevice::WRITE | StorageDevice::CREATE_OVERWRITE);
+        card->CloseFile();
+    }
+
+    RunCase("rotation", 0, [&]() {
+        char path[32], new_path[32];
+        card->Delete("logs/log.7");
+        for (int i = rotation_depth - 2; i >= 0; i--)
+        {
+            snprintf(path, sizeof(path), "logs/log.%d", i);
+            snprintf(new_path, sizeof(new_path), "logs/log.%d", i + 1);
+            card->Rename(path, new_path);
+        }
+        card->CreateDirectory("logs/round.0");
+        card->Rename("logs/log.1", "logs/log.0");
+    });
+
+    RunCase("batched rotation", 0, [&]() {
+        static SDCardMetadataBatch batch(*card);
+        char path[32], new_path[32];
+        batch.Clear();
+        batch.Delete("logs/log.7");
+        for (int i = rotation_depth - 2; i >= 0; i--)
+        {
+            snprintf(path, sizeof(path), "logs/log.%d", i);
+            snprintf(new_path, sizeof(new_path), "logs/log.%d", i + 1);
+            batch.Rename(path, new_path);
+        }
+        batch.CreateDirectory("logs/round.1");
+        batch.Rename("logs/log.1", "logs/log.0");
+        batch.Commit();
+    });
+
+    card->CreateDirectory("captures");
+    RunCase("create files", 0, [&]() {
+        char path[32];
+        for (int i = 0; i < 200; i++)
+        {
+            snprintf(path, sizeof(path), "captures/c%04d.bin", i);
+            card->OpenFile(path, StorageDevice::WRITE | StorageDevice::CREATE_OVERWRITE);
+            card->WriteBuffer(chunk, 64);
+            card->CloseFile();
+        }
+    });
+
+    RunCase("directory counts", 0, [&]() {
+        card->GetTotalCountInDirectory("captures");
+        card->GetFileCountInDirectory("captures");
+        card->GetDirectoryCountInDirectory("captures");
+    });
+
+    RunCase("directory summary", 0, [&]() {
+        card->GetDirectorySummary("captures");
+    });
+
+    RunCase("peek directory", 0, [&]() {
+        card->PeekDirectory("captures");
+    });
+
+    RunCase("compact listing", 0, [&]() {
+        static uint8_t memory[4096];
+        SDCardDirectoryListing listing(memory, sizeof(memory));
+        size_t pages = 0;
+        for (size_t offset = 0; card->ListDirectory("captures", listing, offset) && listing.HasMore(); offset = listing.GetNextOffset())
+            pages++;
+        printf("%-24s %zu pages of 4 KB\n", "", pages + 1);
+    });
+
+    RunCase("polled stats", 0, [&]() {
+        for (int i = 0; i < 100; i++)
+        {
+            card->Exists("captures/c0100.bin");
+            card->GetFileSize("telemetry.txt");
+            card->Exists("missing.cfg");
+        }
+    });
+
+    // more names than the stat cache holds, present and missing
+    auto lookup_captures = [&]() {
+        char path[32];
+        for (int i = 0; i < 400; i++)
+        {
+            snprintf(path, sizeof(path), "captures/c%04d.bin", i);
+            card->Exists(path);
+        }
+    };
+    RunCase("directory lookups", 0, lookup_captures);
+    card->IndexDirectory("captures");
+    RunCase("indexed lookups", 0, lookup_captures);
+    card->DropDirectoryIndex("captures");
+
+    RunCase("free space", 0, [&]() {
+        for (int i = 0; i < 10; i++)
+            card->GetSpaceUsedPercentage();
+    });
+
+    RunCase("remount", 0, [&]() {
+        card->Unmount();
+        card->Mount();
+        card->GetFreeSpace();
+
+        const SDCard::MountTiming& timing = card->GetMountTiming();
+        printf("%-24s init %u us  parse %u us  free count %u us  fast %d\n", "",
+            timing.card_init_us, timing.volume_parse_us, timing.free_count_us, timing.fast_remount);
+    });
+
+    // errors on every 16th transfer above 20 MHz, until the clock policy settles below that
+    SDCardImage::LinkModel link;
+    link.clean_up_to_hz = 20 * 1000 * 1000;
+    link.error_every = 16;
+    card->SetLinkModel(link);
+    SDCardClockPolicy::Config clock = card->GetClockPolicy().GetConfig();
+    clock.start_hz = clock.max_hz;
+    card->SetClockConfig(clock);
+    card->ResetLinkCounters();
+    RunCase("flaky link read", total_size, [&]() {
+        card->OpenFile("bench.bin", StorageDevice::READ | StorageDevice::OPEN_EXISTING);
+        while (card->ReadBuffer(chunk, chunk_size) == chunk_size);
+        card->CloseFile();
+
+        const SDCardClockPolicy::Counters& counters = card->GetLinkCounters();
+        printf("%-24s clock %u Hz  crc %u  timeouts %u  retries %u  down %u  up %u\n", "",
+            card->GetBusClock(), counters.crc_errors, counters.timeouts, counters.retries, counters.step_downs, counters.step_ups);
+    });
+    card->SetLinkModel({});
+
+    // A second card on an image next to the first, as if on the other bus. Card time is the
+    // first card's share; with both working at once, the array takes as long as the slower one.
+    static std::string second_path = std::string(argv[1]) + ".1";
+    static SDCardImage second(second_path.c_str(), size_mb * 1024 * 1024, "1:");
+    second.SetTiming(timing);
+    card->Unmount();
+    if (!second.Mount())
+    {
+        second.Unmount();
+        second.Format();
+    }
+    else
+        second.Unmount();
+
+    constexpr size_t array_chunk_size = chunk_size * 16; // several stripes per write
+    static char array_chunk[array_chunk_size];
+    for (size_t i = 0; i < array_chunk_size; i += chunk_size)
+        memcpy(array_chunk + i, chunk, chunk_size);
+
+    SDCard* members[] = {card, &second};
+    for (SDCardArray::Mode mode : {SDCardArray::Mode::STRIPED, SDCardArray::Mode::MIRRORED})
+    {
+        bool striped = mode == SDCardArray::Mode::STRIPED;
+        SDCardArray array(members, 2, mode);
+        if (!array.Mount())
+        {
+            printf("Could not mount %s\n", second_path.c_str());
+            break;
+        }
+        array.Start();
+
+        second.ResetStatistics();
+        RunCase(striped ? "striped write" : "mirrored write", total_size, [&]() {
+            array.OpenFile("array.bin", StorageDevice::WRITE | StorageDevice::CREATE_OVERWRITE);
+            for (size_t written = 0; written < total_size; written += array_chunk_size)
+                array.WriteBuffer(array_chunk, array_chunk_size);
+            array.CloseFile();
+            printf("%-24s second card %9.2f ms\n", "", second.GetStatistics().busy_us / 1000.0);
+        });
+
+        second.ResetStatistics();
+        RunCase(striped ? "striped read" : "mirrored read", total_size, [&]() {
+            array.OpenFile("array.bin", StorageDevice::READ | StorageDevice::OPEN_EXISTING);
+            while (array.ReadBuffer(array_chunk, array_chunk_size) == array_chunk_size);
+            array.CloseFile();
+            printf("%-24s second card %9.2f ms\n", "", second.GetStatistics().busy_us / 1000.0);
+        });
+
+        array.Delete("array.bin");
+        array.Stop();
+        array.Unmount();
+    }
+    card->Mount();
+
+    SDCardSectorCache::Statistics cache = SDCardSectorCache::GetStatistics();
+    printf("sector cache: %u hits  %u misses  %.1f%% hit rate  %u bypassed  %u evictions\n",
+        cache.hits, cache.misses, SDCardSectorCache::GetHitRate() * 100, cache.bypassed, cache.evictions);
+
+    printf("\n");
+    card->DumpMetrics([](const char* line, void*) {
+        fputs(line, stdout);
+    });
+
+    card->Unmount();
+    return 0;
+}
\ No newline at end of file
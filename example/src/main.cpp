@@ -58,6 +58,7 @@ int main()
 
     while (1)
     {
+        sd_detect.Service(); // mounts or unmounts after a card change, outside the IRQ
         tight_loop_contents();
     }
 
@@ -0,0 +1,14 @@
+#pragma once
+
+#include "sd_card.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+size_t sd_get_num();
+sd_card_t* sd_get_by_num(size_t num);
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,66 @@
+#pragma once
+
+// Host stand-in for the no-OS-FatFS sd_card.h. Only the block layer that FatFs
+// reaches through sd_get_by_num() is kept; the SPI/SDIO interfaces do not exist here.
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ff.h"
+#include "diskio.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum
+{
+    SD_IF_NONE,
+    SD_IF_SPI,
+    SD_IF_SDIO
+} sd_if_t;
+
+enum
+{
+    SD_BLOCK_DEVICE_ERROR_NONE = 0,
+    SD_BLOCK_DEVICE_ERROR_WOULD_BLOCK = 1 << 0,
+    SD_BLOCK_DEVICE_ERROR_UNSUPPORTED = 1 << 1,
+    SD_BLOCK_DEVICE_ERROR_PARAMETER = 1 << 2,
+    SD_BLOCK_DEVICE_ERROR_NO_INIT = 1 << 3,
+    SD_BLOCK_DEVICE_ERROR_NO_DEVICE = 1 << 4,
+    SD_BLOCK_DEVICE_ERROR_WRITE_PROTECTED = 1 << 5,
+    SD_BLOCK_DEVICE_ERROR_UNUSABLE = 1 << 6,
+    SD_BLOCK_DEVICE_ERROR_NO_RESPONSE = 1 << 7,
+    SD_BLOCK_DEVICE_ERROR_CRC = 1 << 8,
+    SD_BLOCK_DEVICE_ERROR_ERASE = 1 << 9,
+    SD_BLOCK_DEVICE_ERROR_WRITE = 1 << 10
+};
+typedef int block_dev_err_t;
+
+typedef struct sd_card_state_t
+{
+    DSTATUS m_Status;
+    uint64_t sectors;
+} sd_card_state_t;
+
+typedef struct sd_card_t sd_card_t;
+struct sd_card_t
+{
+    sd_if_t type;
+    void* image_if_p; // owning SDCardImage
+    sd_card_state_t state;
+
+    DSTATUS (*init)(sd_card_t* sd_card_p);
+    void (*deinit)(sd_card_t* sd_card_p);
+    block_dev_err_t (*write_blocks)(sd_card_t* sd_card_p, const uint8_t* buffer, uint64_t ulSectorNumber, uint32_t blockCnt);
+    block_dev_err_t (*read_blocks)(sd_card_t* sd_card_p, uint8_t* buffer, uint64_t ulSectorNumber, uint32_t ulSectorCount);
+    block_dev_err_t (*sync)(sd_card_t* sd_card_p);
+    uint64_t (*get_num_sectors)(sd_card_t* sd_card_p);
+};
+
+bool sd_init_driver();
+
+#ifdef __cplusplus
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,88 @@
+// Host version of the FatFs disk I/O glue. Every drive number is resolved
+// through sd_get_by_num(), exactly like the glue in no-OS-FatFS, so FatFs
+// issues the same block-layer calls it would against a real card.
+
+#include <time.h>
+
+#include "ff.h"
+#include "diskio.h"
+#include "hw_config.h"
+
+bool sd_init_driver()
+{
+    return true; // block devices are wired up by their constructors on the host
+}
+
+DSTATUS disk_status(BYTE pdrv)
+{
+    sd_card_t* sd_card_p = sd_get_by_num(pdrv);
+    if (!sd_card_p)
+        return STA_NOINIT;
+    return sd_card_p->state.m_Status;
+}
+
+DSTATUS disk_initialize(BYTE pdrv)
+{
+    sd_card_t* sd_card_p = sd_get_by_num(pdrv);
+    if (!sd_card_p || !sd_card_p->init)
+        return STA_NOINIT;
+    return sd_card_p->init(sd_card_p);
+}
+
+DRESULT disk_read(BYTE pdrv, BYTE* buff, LBA_t sector, UINT count)
+{
+    sd_card_t* sd_card_p = sd_get_by_num(pdrv);
+    if (!sd_card_p)
+        return RES_PARERR;
+    if (sd_card_p->state.m_Status & STA_NOINIT)
+        return RES_NOTRDY;
+    return sd_card_p->read_blocks(sd_card_p, buff, sector, count) == SD_BLOCK_DEVICE_ERROR_NONE ? RES_OK : RES_ERROR;
+}
+
+DRESULT disk_write(BYTE pdrv, const BYTE* buff, LBA_t sector, UINT count)
+{
+    sd_card_t* sd_card_p = sd_get_by_num(pdrv);
+    if (!sd_card_p)
+        return RES_PARERR;
+    if (sd_card_p->state.m_Status & STA_NOINIT)
+        return RES_NOTRDY;
+    if (sd_card_p->state.m_Status & STA_PROTECT)
+        return RES_WRPRT;
+    return sd_card_p->write_blocks(sd_card_p, buff, sector, count) == SD_BLOCK_DEVICE_ERROR_NONE ? RES_OK : RES_ERROR;
+}
+
+DRESULT disk_ioctl(BYTE pdrv, BYTE cmd, void* buff)
+{
+    sd_card_t* sd_card_p = sd_get_by_num(pdrv);
+    if (!sd_card_p)
+        return RES_PARERR;
+
+    switch (cmd)
+    {
+    case CTRL_SYNC:
+        return sd_card_p->sync(sd_card_p) == SD_BLOCK_DEVICE_ERROR_NONE ? RES_OK : RES_ERROR;
+    case GET_SECTOR_COUNT:
+        *(LBA_t*)buff = sd_card_p->get_num_sectors(sd_card_p);
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *(WORD*)buff = FF_MIN_SS;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *(DWORD*)buff = 1; // erase block size unknown for an image
+        return RES_OK;
+    default:
+        return RES_PARERR;
+    }
+}
+
+DWORD get_fattime(void)
+{
+    time_t now = time(NULL);
+    struct tm* t = localtime(&now);
+    return ((DWORD)(t->tm_year - 80) << 25)
+        | ((DWORD)(t->tm_mon + 1) << 21)
+        | ((DWORD)t->tm_mday << 16)
+        | ((DWORD)t->tm_hour << 11)
+        | ((DWORD)t->tm_min << 5)
+        | ((DWORD)t->tm_sec >> 1);
+}
\ No newline at end of file
@@ -1,37 +1,355 @@
 #pragma once
 
+#ifndef PICO_SD_HOST
 #include <hardware/GPIODevice.h>
+#endif
 #include <storage/StorageDevice.h>
+#include "SDCardClockPolicy.h"
+#include "SDCardMetrics.h"
+#include "SDCardNameIndex.h"
 
 #include <vector>
 
 #include <hw_config.h>
 
 class SDCardDetector;
+class SDCardContiguousWriter;
+class SDCardAsyncWriter;
+class SDCardRecordLog;
+class SDCardSectorCache;
+class SDCardArray;
+class SDCardDirectoryListing;
+
+#ifndef PICO_SD_MAX_OPEN_FILES
+#define PICO_SD_MAX_OPEN_FILES 4
+#endif
+
+#ifndef PICO_SD_STAT_CACHE_SIZE
+#define PICO_SD_STAT_CACHE_SIZE 8
+#endif
+
+#ifndef PICO_SD_NAME_INDEX_COUNT
+#define PICO_SD_NAME_INDEX_COUNT 2
+#endif
 
 // Please use this class as STATIC MEMORY. I do not know why,
 // but it will CRASH on mounting if it is not declared outside all functions.
 class SDCard : public StorageDevice
 {
+public:
+    using FileHandle = int;
+
+    static constexpr size_t max_open_files = PICO_SD_MAX_OPEN_FILES;
+    static constexpr FileHandle invalid_handle = -1;
+    static constexpr FileHandle default_handle = 0; // the file behind OpenFile and CloseFile
+
+    static constexpr size_t stat_cache_size = PICO_SD_STAT_CACHE_SIZE; // 0 turns the cache off
+    static constexpr size_t stat_cache_path_length = 64; // longer paths always go to f_stat
+
+    static constexpr size_t name_index_count = PICO_SD_NAME_INDEX_COUNT; // directories that can be indexed at once
+
+    struct StatCacheCounters
+    {
+        uint32_t hits;
+        uint32_t misses;
+    };
+
+    struct Range
+    {
+        uint64_t begin_index;
+        uint64_t end_index; // exclusive
+    };
+
+    // A zeroed filter lets everything through.
+    struct DirectoryFilter
+    {
+        const char* name_pattern; // '*' and '?' wildcards, case-insensitive. nullptr matches all
+        uint8_t required_attributes; // AM_* bits that must be set
+        uint8_t excluded_attributes; // AM_* bits that must be clear
+    };
+
+    // Where the time of the last Mount went. free_count_us is filled in when the free cluster
+    // count is first needed, and stays 0 if it came from FSINFO or the last mount of this card.
+    struct MountTiming
+    {
+        uint32_t card_init_us;
+        uint32_t volume_parse_us; // boot sector and FSINFO
+        uint32_t free_count_us; // the FAT scan, when one was needed
+        bool lazy; // initialisation and parsing happened on the first access instead
+        bool fast_remount; // the free count was taken over from the previous mount
+    };
+
+    struct DirectorySummary
+    {
+        size_t file_count;
+        size_t directory_count;
+        uint64_t total_bytes; // sum of the file sizes
+    };
+
+    // Gets a piece of the file that starts at offset. Return false to stop reading.
+    using ChunkVisitor = bool (*)(const uint8_t* data, size_t size, uint64_t offset, void* user_data);
+
+    // Return false to stop the walk early.
+    using DirectoryVisitor = bool (*)(const DirectoryEntry& entry, const FILINFO& info, void* user_data);
+
+    // Walks a directory one f_readdir at a time, yielding only the entries that pass the filter.
+    // Nothing is buffered, so it works for directories of any size.
+    class DirectoryIterator
+    {
+    private:
+        DIR dir = {};
+        FILINFO info = {};
+        DirectoryFilter filter;
+        bool is_open;
+
+    public:
+        DirectoryIterator(const char* dir_path, const DirectoryFilter& filter = {});
+        ~DirectoryIterator();
+
+        DirectoryIterator(const DirectoryIterator&) = delete;
+        DirectoryIterator& operator=(const DirectoryIterator&) = delete;
+
+        bool Next(DirectoryEntry& entry);
+        bool Next(); // only advances, see GetInfo
+
+        // Raw FatFs information of the entry Next last returned, including its size.
+        inline const FILINFO& GetInfo() const
+        {
+            return info;
+        }
+
+        inline bool IsOpen() const
+        {
+            return is_open;
+        }
+    };
+
 private:
     static std::vector<SDCard*> _insts;
 
     static DirectoryEntry GetEntryFromFatFsStat(const FILINFO& info);
     static uint32_t TranslateFileAccessFlags(uint32_t access);
+    static bool MatchesFilter(const FILINFO& info, const DirectoryFilter& filter);
+    static bool MatchPattern(const char* pattern, const char* name);
+    static const uint8_t* FindInBlock(const uint8_t* block, size_t size, const uint8_t* pattern, size_t length);
+    static const uint8_t* FindLastInBlock(const uint8_t* block, size_t size, const uint8_t* pattern, size_t length);
+
+    // Finds the first match starting at or after start, reading the file in sector-aligned blocks.
+    // Leaves the file pointer somewhere past the scanned region.
+    int64_t ScanForward(const void* pattern, size_t length, uint64_t start);
+    int64_t FindNext(const void* pattern, size_t length, bool keep_index);
+
+    // Finds the occurrence-th match starting before the given offset, counting back from it,
+    // reading the file in sector-aligned blocks from the end towards the start.
+    int64_t ScanBackward(const void* pattern, size_t length, uint64_t before, size_t occurrence = 1);
+    int64_t FindPrevious(const void* pattern, size_t length, bool keep_index);
+
+    // Writes at the file pointer, through the write buffer when one is set.
+    size_t WriteData(const void* data, size_t size);
+    // Hands buffered bytes to FatFs. Unless all is set, a tail that would end mid-sector stays buffered.
+    bool DrainWriteBuffer(bool all);
+    bool FlushWriteBuffer();
+
+    // Runs fn with handle selected, then puts the previous selection back.
+    template<typename T, typename F>
+    T WithHandle(FileHandle handle, T fail, F&& fn)
+    {
+        if (handle < 0 || handle >= (FileHandle)max_open_files)
+            return fail;
+
+        FileSlot* prev = active;
+        SelectHandle(handle);
+        T result = fn();
+        SelectHandle(prev - file_slots);
+        return result;
+    }
 
 protected:
+    static constexpr size_t block_buffer_size = FF_MIN_SS * 4;
+
     sd_card_t card;
+    uint8_t block_buffer[block_buffer_size]; // scratch for block-wise scans
+
+    // Block functions that were in card before a layer went in front of them.
+    struct BlockLayer
+    {
+        decltype(sd_card_t::read_blocks) read_blocks;
+        decltype(sd_card_t::write_blocks) write_blocks;
+        decltype(sd_card_t::sync) sync;
+    };
+
+    BlockLayer raw_block_layer = {}; // underneath SDCardSectorCache
+    bool writes_held = false; // see SDCardSectorCache::HoldWrites
+    BlockLayer driver_block_layer = {}; // the driver's own, underneath the link monitor
+
+    // Retries of a transfer that failed with a CRC error or timeout, before giving up on it.
+    static constexpr uint32_t link_retries = 2;
+
+    SDCardClockPolicy clock_policy{SDCardClockPolicy::Config{}}; // does nothing until an interface configures it
+
+    static SDCard* GetByCard(sd_card_t* sd_card_p);
+    static SDCardClockPolicy::Outcome ClassifyResult(block_dev_err_t result);
+
+    // The link monitor sits directly on the driver, so it sees every transfer the card does.
+    static block_dev_err_t LinkReadBlocks(sd_card_t* sd_card_p, uint8_t* buffer, uint64_t sector, uint32_t count);
+    static block_dev_err_t LinkWriteBlocks(sd_card_t* sd_card_p, const uint8_t* buffer, uint64_t sector, uint32_t count);
+    static block_dev_err_t LinkSync(sd_card_t* sd_card_p);
+    void AttachLinkMonitor();
+    void DetachLinkMonitor();
+    void ApplyBusClock();
+
+    // Runs a transfer on the driver, retrying it on CRC errors and timeouts,
+    // and moves the bus clock whenever the policy says so.
+    template<typename F>
+    block_dev_err_t OnLink(F&& transfer)
+    {
+        for (uint32_t attempt = 0; ; attempt++)
+        {
+            block_dev_err_t result = transfer();
+            SDCardClockPolicy::Outcome outcome = ClassifyResult(result);
+            if (clock_policy.Record(outcome))
+                ApplyBusClock();
+
+            if (outcome == SDCardClockPolicy::Outcome::OK || outcome == SDCardClockPolicy::Outcome::OTHER_ERROR || attempt == link_retries)
+                return result;
+            clock_policy.RecordRetry();
+        }
+    }
+
+    // Changes the clock of the bus to the card. Returns false if the interface cannot do it
+    // right now; it should then take the rate over at the next card initialisation.
+    virtual bool SetBusClock(uint32_t hz);
+
+    mutable SDCardMetrics metrics;
+
+    // f_lseek, counted.
+    FRESULT Lseek(FIL* fp, FSIZE_t offset);
+
+    // Raw access to the card's block layer, underneath FatFs. Sectors are absolute.
+    bool ReadSectors(void* buffer, LBA_t sector, uint32_t count);
+    bool WriteSectors(const void* buffer, LBA_t sector, uint32_t count);
     
+    // One entry of the open file pool. Every open file keeps its own FatFs object,
+    // position and optional write buffer, so switching between them costs nothing.
+    struct FileSlot
+    {
+        FIL file = {};
+        const char* path = nullptr;
+        bool is_open = false;
+
+        uint8_t* write_buffer = nullptr;
+        size_t write_buffer_size = 0;
+        size_t write_buffered = 0; // bytes waiting in write_buffer, they belong at the file pointer
+
+        bool streaming = false;
+        bool stream_preallocated = false; // BeginStream expanded the file, EndStream trims it
+    };
+
+    // Remembers f_stat results, including "not there", for the paths asked about most recently.
+    struct StatCacheEntry
+    {
+        char path[stat_cache_path_length];
+        FILINFO info;
+        FRESULT result;
+        uint32_t last_used;
+        bool valid = false;
+    };
+
     mutable DIR directory = {};
-    FIL file = {};
+    mutable StatCacheEntry stat_cache[stat_cache_size ? stat_cache_size : 1];
+    mutable uint32_t stat_cache_clock = 0;
+    mutable StatCacheCounters stat_cache_counters = {};
+    mutable SDCardNameIndex name_indexes[name_index_count ? name_index_count : 1];
+    bool at_root = true; // the current directory, as far as relative paths reach the indexes
+    FileSlot file_slots[max_open_files];
+    FileSlot* active; // the slot the single-file methods work on
     mutable FATFS fs;
-    const char* current_file_path;
     const char* pc_name;
 
+    // What the last mounted volume looked like, so mounting the same card again can take over
+    // the free cluster count instead of walking the FAT for it. The serial and geometry are
+    // taken at Mount, as the card may already be gone by Unmount, and the counts at Unmount.
+    struct VolumeMemo
+    {
+        bool identified; // serial and geometry are of the mounted volume
+        bool valid; // the counts were saved when it was unmounted
+        uint32_t serial;
+        LBA_t volbase;
+        DWORD n_fatent;
+        DWORD fsize;
+        DWORD free_clst;
+        DWORD last_clst;
+    };
+
+    bool lazy_mount = false;
+    mutable MountTiming mount_timing = {};
+    VolumeMemo volume_memo = {};
+
+    // Where path goes on from the root of this volume, past the drive and the separators.
+    // Nullptr when that is not known here: another drive, "." or "..", bytes outside ASCII,
+    // or a relative path while the current directory is not the root.
+    const char* FromRoot(const char* path) const;
+    // The index of the directory path is in, if there is one. name is set to the last part of
+    // path, or to nullptr when FromRoot cannot place path and no index can be trusted with it.
+    SDCardNameIndex* FindNameIndex(const char* path, const char*& name) const;
+    // Indexes of the directory below path, and of path itself, go with path.
+    void InvalidateNameIndexesBelow(const char* path) const;
+    // f_stat, answered by the name index where it can.
+    FRESULT IndexedStat(const char* path, FILINFO* info) const;
+    // False only when the name index knows path is not there.
+    bool MayExist(const char* path) const;
+    // Keep the name indexes up to date after path was created, or deleted or moved away.
+    void NoteAdded(const char* path) const;
+    void NoteRemoved(const char* path) const;
+    // f_open, failing early for a file the name index knows is not there.
+    bool OpenIndexed(FIL* file, const char* path, BYTE mode);
+    void InvalidateNameIndexes() const;
+
+    bool ReadVolumeSerial(uint32_t& serial);
+    // Keeps the free counts of the volume being unmounted, without touching the card.
+    void SaveVolumeMemo();
+    // Takes the free count from the memo if the mounted volume matches it and FatFs does not know
+    // it yet, then identifies the mounted volume for the next SaveVolumeMemo.
+    bool RestoreVolumeMemo();
+
 public:
     SDCard(const char* pc_name = "");
     virtual ~SDCard();
 
+    // core1 runs one worker at a time, whichever of SDCardAsyncWriter, SDCardAsyncIO and
+    // SDCardArray started first. Claim returns false while another owner holds it.
+    static bool ClaimCore1(const void* owner);
+    static void ReleaseCore1(const void* owner);
+
+    // f_stat through the stat cache.
+    FRESULT CachedStat(const char* path, FILINFO* info) const;
+    // Drops every cached entry. Each change made through this object does so too, as one file
+    // goes by many paths ("/log.txt", "log.txt", "0:LOG.TXT") and the cache keys them as given.
+    // Only needed after changing the card behind this object's back.
+    void InvalidateStatCache() const;
+
+    inline StatCacheCounters GetStatCacheCounters() const
+    {
+        return stat_cache_counters;
+    }
+
+    inline void ResetStatCacheCounters()
+    {
+        stat_cache_counters = {};
+    }
+
+    // Looks names in dir_path up through a hash index from now on, see SDCardNameIndex.
+    // Paths reach the index when their directory part names the same directory from the root,
+    // with or without this card's drive, and relative ones while the current directory is the root.
+    // Returns false when all name_index_count indexes are taken, or the path is too long
+    // or one FromRoot cannot place.
+    bool IndexDirectory(const char* dir_path);
+    // Has the index of dir_path built again on its next lookup, for after creating many files.
+    void RefreshDirectoryIndex(const char* dir_path);
+    // Frees the index of dir_path, or every index when it is nullptr.
+    void DropDirectoryIndex(const char* dir_path = nullptr);
+    const SDCardNameIndex* GetDirectoryIndex(const char* dir_path) const;
+
     FILINFO GetFileStats(const char* path) const;
     FILINFO GetFileStats() const;
 
@@ -41,15 +359,124 @@ public:
     size_t GetDirectoryCountInDirectory(const char* dir_path) const override;
     DirectoryEntry GetDirectoryEntry(const char* path) const override;
 
+    // Calls visitor for every entry that passes the filter, in one pass. Returns how many were visited.
+    size_t ForEachInDirectory(const char* dir_path, DirectoryVisitor visitor, void* user_data = nullptr, const DirectoryFilter& filter = {}) const;
+    // Fills listing with the entries that pass the filter, skipping the first offset of them,
+    // until count are in, the listing's budget is used up or the directory ends. count 0 means
+    // as many as fit. Returns how many were stored. The skipped entries are still read, so
+    // paging through a directory costs a scan up to each page.
+    size_t ListDirectory(const char* dir_path, SDCardDirectoryListing& listing, size_t offset = 0, size_t count = 0, const DirectoryFilter& filter = {}) const;
+    // File count, directory count and total file bytes from a single scan.
+    DirectorySummary GetDirectorySummary(const char* dir_path, const DirectoryFilter& filter = {}) const;
+
     bool ChangeDirectory(const char* path) override;
     bool CreateDirectory(const char* dir_path) override;
     bool Move(const char* path, const char* new_path); // Move and Rename do the same thing override.
     bool Rename(const char* name, const char* new_name) override;
 
+    // Unless lazy mounting is on, the card is initialised and the volume parsed right away.
+    // Lazily, Mount only registers the volume and FatFs does both on the first access, so a
+    // device that wakes up, mounts and goes back to sleep without touching the card pays nothing.
     bool Mount() override;
     bool Unmount() override;
+
+    inline void SetLazyMount(bool lazy)
+    {
+        lazy_mount = lazy;
+    }
+
+    inline const MountTiming& GetMountTiming() const
+    {
+        return mount_timing;
+    }
+
+    // The clock starts over at config.start_hz on every Mount. Interfaces set a config
+    // matching their hardware in the constructor; this replaces it.
+    void SetClockConfig(const SDCardClockPolicy::Config& config);
+
+    inline uint32_t GetBusClock() const
+    {
+        return clock_policy.GetRate();
+    }
+
+    inline const SDCardClockPolicy& GetClockPolicy() const
+    {
+        return clock_policy;
+    }
+
+    inline const SDCardClockPolicy::Counters& GetLinkCounters() const
+    {
+        return clock_policy.GetCounters();
+    }
+
+    inline void ResetLinkCounters()
+    {
+        clock_policy.ResetCounters();
+    }
+
+    // Call counts, bytes, block-layer sectors, seeks and latency histograms per operation,
+    // see SDCardMetrics. Copying them out is a plain memcpy of about 2.5 KB, so keep the
+    // snapshot in static memory rather than on a core's stack.
+    inline void GetMetrics(SDCardMetrics::Data& out) const
+    {
+        metrics.Snapshot(out);
+    }
+
+    inline void ResetMetrics()
+    {
+        metrics.Reset();
+    }
+
+    // Writes the current counters line by line, for printf or for a file on a card.
+    inline void DumpMetrics(SDCardMetrics::LineWriter writer, void* user_data = nullptr) const
+    {
+        metrics.Dump(writer, user_data);
+    }
+
     bool OpenFile(const char* file_path, uint32_t access_mask) override;
     bool CloseFile() override;
+
+    // Files beyond the default one live in a fixed pool of max_open_files slots.
+    // OpenHandle never closes another file. The single-file methods below (ReadBuffer,
+    // Seek, SetWriteBuffer, ...) work on the selected handle, which is default_handle
+    // unless SelectHandle says otherwise.
+    FileHandle OpenHandle(const char* file_path, uint32_t access_mask);
+    bool CloseHandle(FileHandle handle);
+    bool SelectHandle(FileHandle handle);
+
+    inline FileHandle GetSelectedHandle() const
+    {
+        return active - file_slots;
+    }
+
+    size_t ReadBuffer(FileHandle handle, void* buffer, size_t max_bytes);
+    size_t WriteBuffer(FileHandle handle, const void* buffer, size_t max_bytes);
+    bool Seek(FileHandle handle, uint64_t index);
+    bool Flush(FileHandle handle);
+
+    // Opt-in coalescing of small writes, per file. Writes collect in the given memory and reach FatFs
+    // in pieces that end on sector boundaries, which avoids a read-modify-write of a partial
+    // sector on every small write. A size of a sector multiple, ideally a cluster, works best.
+    // Buffered data is written out on Flush, any Seek, reads, CloseFile and Unmount.
+    // Pass nullptr to write straight through again.
+    bool SetWriteBuffer(void* buffer, size_t size);
+    // Writes out the write buffer and syncs the file to the card.
+    bool Flush();
+
+    // Sequential stream mode for the selected file. Successive WriteBuffer calls reach the card as
+    // one contiguous run of sectors, which the driver keeps as a single open multi-block write
+    // (CMD25) until Flush, a Seek, CloseFile or EndStream stops it; reads, finds, appends and
+    // clears end it first as well. Pair it with a write buffer so every write ends on a sector
+    // boundary and FatFs never reads in the middle of the run.
+    // With expected_bytes on an empty file, the clusters are allocated up front as well and
+    // the excess is trimmed at the end.
+    bool BeginStream(uint64_t expected_bytes = 0);
+    bool EndStream();
+
+    inline bool IsStreaming() const
+    {
+        return is_file_open && active->streaming;
+    }
     
     bool Seek(uint64_t index) override;
     bool SeekStart() override;
@@ -58,14 +485,40 @@ public:
 
     uint64_t GetFileSize(const char* path) const override;
     uint64_t GetFileSize() const override;
+    // The free cluster count is counted once, on the first query after Mount, then kept up to date
+    // by FatFs as clusters are allocated and released, so later queries do not touch the card.
     uint64_t GetFreeSpace() const override;
-    uint64_t GetTotalSpace() const override;
+    uint64_t GetTotalSpace() const override; // in bytes
     float GetSpaceUsedPercentage() const override;
+    // Counts the free clusters again from the FAT, for when the card was changed elsewhere.
+    bool RecomputeFreeSpace();
+
+    // Creates (or empties) a file and allocates bytes of contiguous clusters for it up front,
+    // so later writes never have to search the FAT or extend the cluster chain.
+    // The file reads back as bytes long until it is written and truncated.
+    bool PreallocateFile(const char* path, uint64_t bytes);
+    uint32_t GetSectorSize() const;
 
     size_t ReadBuffer(void* buffer, size_t max_bytes) override;
     char ReadCharacter() override;
+    // Allocates the rest of the file, from the file pointer on, in one piece. Prefer StreamFile
+    // or the arena overload below for anything large.
     size_t ReadAll(UniqueArray<char>& buffer) override;
+    // Reads the rest of the file into caller memory. Reads nothing and returns 0 if it does not
+    // fit in capacity bytes.
+    size_t ReadAll(void* arena, size_t capacity);
+    // Reads from the file pointer to the end of the file, handing each piece to visitor as it
+    // arrives, without allocating. Pieces are read into buffer, or block_buffer when it is nullptr,
+    // and after the first they start on sector boundaries and fill whole sectors of it.
+    // buffer_size is rounded down to whole sectors. Returns the bytes read, which stops short
+    // when the visitor returns false.
+    uint64_t StreamFile(ChunkVisitor visitor, void* user_data = nullptr, void* buffer = nullptr, size_t buffer_size = 0);
+    // Reads up to and including the next newline into buffer, terminated, and returns its length.
+    // buffer.length is the size of the array both ways: a longer line swaps in a larger one.
     size_t ReadLine(UniqueArray<char>& buffer, bool from_start_of_line = false) override;
+    // Reads the final line_count lines of the file, like tail -n, without scanning it from the start.
+    // The file pointer is left where it was. A failed read leaves an empty string and returns 0.
+    size_t ReadLastLines(UniqueArray<char>& buffer, size_t line_count);
 
     size_t WriteBuffer(const void* buffer, size_t max_bytes) override;
     size_t WriteString(const char* str) override;
@@ -84,6 +537,10 @@ public:
 
     bool ClearFile(uint64_t begin_index, uint64_t end_index) override;
     bool ClearFile(uint64_t begin_index = 0) override;
+    // Removes several ranges from the open file in one pass: the kept data is moved forward
+    // through a fixed-size buffer and the file is truncated once at the end.
+    // The ranges are sorted and merged in place.
+    bool ClearRanges(Range* ranges, size_t count);
 
     bool Delete(const char* file_path) override;
     bool Delete() override;
@@ -94,13 +551,61 @@ public:
     friend sd_card_t* sd_get_by_num(size_t num);
 
     friend SDCardDetector;
+    friend SDCardContiguousWriter;
+    friend SDCardAsyncWriter;
+    friend SDCardRecordLog;
+    friend SDCardSectorCache;
+    friend SDCardArray;
 };
 
+#ifndef PICO_SD_HOST
+#ifndef PICO_SD_DETECT_EVENT_POOL_SIZE
+#define PICO_SD_DETECT_EVENT_POOL_SIZE 4
+#endif
+
+// The GPIOEvent SDCardDetector posts. It comes from a fixed pool rather than the heap,
+// so it can be created in the IRQ handler; deleting it, wherever the event queue is
+// drained, puts it back. new yields nullptr while the whole pool is in the queue.
+class SDCardDetectEvent : public GPIOEvent
+{
+public:
+    static constexpr size_t pool_size = PICO_SD_DETECT_EVENT_POOL_SIZE;
+
+    using GPIOEvent::GPIOEvent;
+
+    static void* operator new(size_t size) noexcept;
+    static void operator delete(void* ptr) noexcept;
+};
+
+// Watches the card-detect pin. The IRQ handler only records the change and posts the event.
+// With auto_mount, Service, which the main loop or core1 calls, does the unmount and mount
+// itself, because mounting initialises the card and reads the FAT and would otherwise hold off
+// every other interrupt for that long. Without it, the card and its caches are left as they
+// are until the caller unmounts it.
 class SDCardDetector : public GPIODeviceDebounce
 {
+public:
+    struct IRQStatistics
+    {
+        uint32_t irq_count;
+        uint32_t max_irq_us;
+        uint64_t total_irq_us;
+        uint32_t events_dropped; // the event pool was empty
+    };
+
 private:
+    enum PendingAction : uint8_t
+    {
+        PENDING_NONE,
+        PENDING_MOUNT,
+        PENDING_UNMOUNT
+    };
+
     SDCard* card;
     bool auto_mount;
+    volatile PendingAction pending = PENDING_NONE; // the latest card change wins
+    volatile bool removed = false; // a falling edge since the last Service
+    IRQStatistics irq_stats = {};
 
 protected:
     void HandleIRQ(uint32_t events_triggered_mask) override;
@@ -112,4 +617,12 @@ public:
     {
         this->card = card;
     }
-};
\ No newline at end of file
+
+    // Mounts or unmounts the card if it was inserted or removed since the last call.
+    // Returns true if it did either.
+    bool Service();
+
+    IRQStatistics GetIRQStatistics() const;
+    void ResetIRQStatistics();
+};
+#endif
\ No newline at end of file
@@ -0,0 +1,207 @@
+#pragma once
+
+#include "SDCard.h"
+
+#include <atomic>
+
+#ifdef PICO_SD_HOST
+#include <thread>
+#endif
+
+// Several SDCards, each with its own FAT volume, as one StorageDevice. Every file and
+// directory exists under the same path on each card; paths are given without a drive and
+// the array puts each card's name in front.
+//
+// STRIPED: file data is dealt out to the cards in stripe_size pieces, RAID-0 style, so card i
+// holds stripes i, i + n, i + 2n, ... one after another in its own copy of the file. A file of
+// n stripes costs each card one, and losing a card loses every file.
+// MIRRORED: every card holds the whole file and every write goes to all of them. Every card is
+// idle again by the time the next read comes, so reads go to the cards in turn, except one that
+// carries on inside the sector the last ended in, which stays with the card holding it. A read
+// of a stripe per card or more is split so each card reads its own part.
+//
+// After Start, the cards with odd indices do their share of each transfer on core1 (a thread
+// on the host) while the caller does the even ones, so cards on different buses, one on SDIO
+// and one on SPI, transfer at the same time. Without Start they take turns. Only the reads,
+// writes, seeks and flushes of the open file run in parallel; everything that takes a path
+// stays on the caller's core, as FatFs shares its long file name buffer between volumes.
+// core1 belongs to the array between Start and Stop.
+class SDCardArray : public StorageDevice
+{
+public:
+    static constexpr size_t max_cards = 4;
+    static constexpr size_t path_length = 128; // including the drive
+
+    enum class Mode
+    {
+        STRIPED,
+        MIRRORED
+    };
+
+    struct Statistics
+    {
+        uint32_t parallel_transfers;
+        uint32_t serial_transfers;
+        uint64_t busy_us[max_cards]; // time each card spent in its share of the transfers
+    };
+
+private:
+    enum class Op : uint8_t
+    {
+        READ,
+        WRITE,
+        FLUSH
+    };
+
+    // What every card does a share of. Written by the caller before the worker is woken.
+    struct Transfer
+    {
+        Op op;
+        uint8_t* data;
+        uint64_t position; // logical
+        size_t bytes;
+        size_t part; // MIRRORED reads: bytes per card, 0 when one card does all of it
+        size_t reader; // MIRRORED reads without a split: the card doing it
+    };
+
+    SDCard* cards[max_cards];
+    size_t card_count;
+    Mode mode;
+    uint32_t stripe_size;
+
+    uint64_t position = 0; // logical file pointer
+    char open_paths[max_cards][path_length]; // the cards keep pointers to these while the file is open
+    uint8_t block_buffer[FF_MIN_SS * 4]; // scratch for searches and clears
+
+    Transfer transfer = {};
+    size_t last_reader = 0; // MIRRORED reads without a split
+    uint64_t last_read_end = 0;
+    uint64_t transfer_end[max_cards]; // logical offset each card's share got to
+    Statistics stats = {};
+
+    // Sequence numbers of handed out and finished transfers.
+    uint32_t sequence = 0;
+    std::atomic<uint32_t> requested = 0;
+    std::atomic<uint32_t> completed = 0;
+    std::atomic<bool> stop_requested = false;
+    std::atomic<bool> worker_running = false;
+
+#ifdef PICO_SD_HOST
+    std::thread worker;
+#else
+    static SDCardArray* core1_array;
+    static void Core1Entry();
+#endif
+
+    void Wake();
+    void Idle();
+    void Work();
+
+    // Offset in card index's copy of the file that holds the first of its bytes at or after logical.
+    uint64_t MemberOffset(size_t index, uint64_t logical) const;
+    // Writes the card's name and path into out. nullptr if it does not fit.
+    const char* MemberPath(size_t index, const char* path, char* out) const;
+
+    // Runs the current transfer on the cards with the given parity, or on all with -1.
+    void RunShares(int parity);
+    void RunShare(size_t index);
+    // Runs a transfer on every card and returns how many bytes of it were done on all of them.
+    size_t Run(Op op, uint8_t* data, size_t bytes);
+
+    int64_t ScanForward(const void* pattern, size_t length, uint64_t start);
+    int64_t ScanBackward(const void* pattern, size_t length, uint64_t before);
+    int64_t Find(const void* pattern, size_t length, bool forward, bool keep_index);
+
+public:
+    // stripe_size must be a multiple of the sector size. The cards must be told apart by their
+    // names ("0:", "1:", ...), which also means their position in the card registry.
+    SDCardArray(SDCard* const* cards, size_t card_count, Mode mode = Mode::STRIPED, uint32_t stripe_size = FF_MIN_SS * 32);
+    ~SDCardArray();
+
+    // Starts the worker on core1, or on a thread on the host. Fails while core1 runs another
+    // worker, see SDCard::ClaimCore1.
+    bool Start();
+    bool Stop();
+
+    inline bool IsRunning() const
+    {
+        return worker_running.load(std::memory_order_acquire);
+    }
+
+    inline Mode GetMode() const
+    {
+        return mode;
+    }
+
+    inline const Statistics& GetStatistics() const
+    {
+        return stats;
+    }
+
+    inline void ResetStatistics()
+    {
+        stats = {};
+    }
+
+    // Syncs the open file on every card.
+    bool Flush();
+
+    UniqueArray<DirectoryEntry> PeekDirectory(const char* dir_path) const override;
+    size_t GetTotalCountInDirectory(const char* dir_path) const override;
+    size_t GetFileCountInDirectory(const char* dir_path) const override;
+    size_t GetDirectoryCountInDirectory(const char* dir_path) const override;
+    DirectoryEntry GetDirectoryEntry(const char* path) const override;
+
+    bool ChangeDirectory(const char* path) override;
+    bool CreateDirectory(const char* dir_path) override;
+    bool Rename(const char* name, const char* new_name) override;
+
+    // Mounts every card, or none of them.
+    bool Mount() override;
+    bool Unmount() override;
+
+    bool OpenFile(const char* file_path, uint32_t access_mask) override;
+    bool CloseFile() override;
+
+    bool Seek(uint64_t index) override;
+    bool SeekStart() override;
+    bool SeekEnd() override;
+    bool SeekStep(int64_t d_idx) override;
+
+    uint64_t GetFileSize(const char* path) const override;
+    uint64_t GetFileSize() const override;
+    // What can still be written, limited by the fullest card.
+    uint64_t GetFreeSpace() const override;
+    uint64_t GetTotalSpace() const override;
+    float GetSpaceUsedPercentage() const override;
+
+    size_t ReadBuffer(void* buffer, size_t max_bytes) override;
+    char ReadCharacter() override;
+    size_t ReadAll(UniqueArray<char>& buffer) override;
+    // Reads up to and including the next newline into buffer, terminated, and returns its length.
+    // buffer.length is the size of the array both ways: a longer line swaps in a larger one.
+    size_t ReadLine(UniqueArray<char>& buffer, bool from_start_of_line = false) override;
+
+    size_t WriteBuffer(const void* buffer, size_t max_bytes) override;
+    size_t WriteString(const char* str) override;
+    size_t WriteCharacter(char c) override;
+
+    size_t AppendBuffer(const void* buffer, size_t max_bytes, bool keep_index = true) override;
+    size_t AppendString(const char* str, bool keep_index = true) override;
+    size_t AppendCharacter(char c, bool keep_index = true) override;
+
+    int64_t FindNextBuffer(const void* buffer, size_t max_bytes, bool keep_index = true) override;
+    int64_t FindNextString(const char* str, bool keep_index = true) override;
+    int64_t FindNextCharacter(char c, bool keep_index = true) override;
+    int64_t FindPreviousBuffer(const void* buffer, size_t max_bytes, bool keep_index = true) override;
+    int64_t FindPreviousString(const char* str, bool keep_index = true) override;
+    int64_t FindPreviousCharacter(char c, bool keep_index = true) override;
+
+    bool ClearFile(uint64_t begin_index, uint64_t end_index) override;
+    bool ClearFile(uint64_t begin_index = 0) override;
+
+    bool Delete(const char* file_path) override;
+    bool Delete() override;
+
+    bool Exists(const char* path) const override;
+};
\ No newline at end of file
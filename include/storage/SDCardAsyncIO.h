@@ -0,0 +1,153 @@
+#pragma once
+
+#include "SDCard.h"
+
+#include <atomic>
+
+#ifdef PICO_SD_HOST
+#include <thread>
+#endif
+
+#ifndef PICO_SD_HOST
+class SDCardAsyncIO;
+
+// Posted to Event::event_queue when a ReadAsync or WriteAsync request finishes.
+class SDCardIOEvent : public Event
+{
+private:
+    uint32_t request_id;
+    void* buffer;
+    size_t bytes;
+    bool is_write;
+    bool ok;
+
+public:
+    SDCardIOEvent(SDCardAsyncIO* source, uint32_t request_id, void* buffer, size_t bytes, bool is_write, bool ok);
+
+    inline uint32_t GetRequestId() const
+    {
+        return request_id;
+    }
+
+    // The buffer the request was made with, so the handler can process it and queue it again.
+    inline void* GetBuffer() const
+    {
+        return buffer;
+    }
+
+    // Bytes actually transferred. Less than requested at the end of the file or on an error.
+    inline size_t GetBytes() const
+    {
+        return bytes;
+    }
+
+    inline bool IsWrite() const
+    {
+        return is_write;
+    }
+
+    // False when a write fell short or a read got nothing, which includes reading at the end of the file.
+    inline bool IsOk() const
+    {
+        return ok;
+    }
+};
+#endif
+
+// Reads and writes that return immediately. Requests are queued in order and carried
+// out by a worker, on core1 (or a thread on the host) after Start, or by whoever calls
+// Service. The drivers' DMA completes inside their blocking read and write calls, so the
+// waiting happens on the worker's core instead of the caller's. On the Pico each finished
+// request posts an SDCardIOEvent through Event::event_queue; actions registered with
+// AddAction see it like any other event. Immediate actions are run by the worker as the
+// request finishes, so after Start they run on core1 and must be safe there; the others
+// run wherever the queue is drained. Requests can also be polled by id.
+//
+// Double buffering: queue reads into two buffers, and when the event for one arrives,
+// process it and queue it again. The other one fills in the meantime.
+//
+// The SDCard belongs to the worker between Start and Stop, so only reach it through here.
+class SDCardAsyncIO
+#ifndef PICO_SD_HOST
+    : public EventSource
+#endif
+{
+public:
+    static constexpr size_t queue_depth = 4;
+    static constexpr uint32_t invalid_request = 0;
+
+private:
+    enum State : uint8_t
+    {
+        FREE,
+        QUEUED,
+        DONE
+    };
+
+    struct Request
+    {
+        std::atomic<uint8_t> state = FREE;
+        uint32_t id = invalid_request;
+        SDCard::FileHandle handle;
+        void* buffer;
+        size_t size;
+        size_t result;
+        bool is_write;
+    };
+
+    SDCard* card;
+    Request requests[queue_depth];
+    uint32_t next_id = 1; // submitter only
+    uint32_t next_serviced = 1; // worker only, requests are carried out in id order
+
+    std::atomic<bool> stop_requested = false;
+    std::atomic<bool> worker_running = false;
+    std::atomic<uint32_t> events_dropped = 0;
+
+#ifdef PICO_SD_HOST
+    std::thread worker;
+#else
+    static SDCardAsyncIO* core1_io;
+    static void Core1Entry();
+#endif
+
+    void Wake();
+    void Idle();
+    void Work();
+    uint32_t Submit(SDCard::FileHandle handle, void* buffer, size_t size, bool is_write);
+    Request& Slot(uint32_t id);
+
+public:
+    SDCardAsyncIO(SDCard& card);
+    ~SDCardAsyncIO();
+
+    // Starts the worker on core1, or on a thread on the host. Without it, call Service from a loop.
+    // Fails while core1 runs another worker, see SDCard::ClaimCore1.
+    bool Start();
+    // Finishes every queued request, then stops the worker.
+    bool Stop();
+
+    // Queue a transfer at the file's current position, which advances as each one is carried out.
+    // The buffer must stay untouched until the request is done.
+    // Returns the request id, or invalid_request when all queue_depth requests are outstanding.
+    uint32_t ReadAsync(SDCard::FileHandle handle, void* buffer, size_t max_bytes);
+    uint32_t WriteAsync(SDCard::FileHandle handle, const void* buffer, size_t max_bytes);
+
+    bool IsDone(uint32_t request_id) const;
+    // Blocks until the request is done and returns the bytes transferred. The count is kept
+    // until queue_depth newer requests have been made, after that it reads as 0.
+    size_t Wait(uint32_t request_id);
+    // Carries out the oldest queued request, if any. Returns false when there was none.
+    bool Service();
+
+    inline bool IsRunning() const
+    {
+        return worker_running.load(std::memory_order_acquire);
+    }
+
+    // Finish events that did not fit in Event::event_queue. Their requests are done all the same.
+    inline uint32_t GetEventsDropped() const
+    {
+        return events_dropped.load(std::memory_order_relaxed);
+    }
+};
\ No newline at end of file
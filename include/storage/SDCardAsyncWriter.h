@@ -0,0 +1,103 @@
+#pragma once
+
+#include "SDCard.h"
+
+#include <atomic>
+
+#ifdef PICO_SD_HOST
+#include <thread>
+#endif
+
+// Moves file writes off the caller's core. The producer copies records into a lock-free
+// single-producer/single-consumer ring with Push, which never touches the card and never
+// blocks. A consumer, on core1 (or a thread on the host) after Start, or whoever calls
+// Service, drains the ring into the file in whole chunks that end on chunk boundaries of
+// the file, so a card stalling in garbage collection only fills the ring instead of
+// holding up the producer. The SDCard belongs to the consumer between Open and Close;
+// the producer must not use it for anything else in that time.
+class SDCardAsyncWriter
+{
+public:
+    struct Statistics
+    {
+        uint32_t high_water; // most bytes ever waiting in the ring
+        uint32_t overflows; // records dropped because the ring was full
+        uint32_t dropped_bytes;
+        uint32_t chunks_written;
+        uint32_t write_errors;
+    };
+
+private:
+    SDCard* card;
+    SDCard::FileHandle handle = SDCard::invalid_handle;
+
+    uint8_t* ring;
+    size_t ring_size;
+    size_t chunk_size;
+    size_t align_offset = 0; // file size at Open, chunks are aligned to the file rather than the ring
+
+    // Free-running byte counts. head is written by the producer only, tail by the consumer only.
+    std::atomic<size_t> head = 0;
+    std::atomic<size_t> tail = 0;
+
+    std::atomic<bool> flush_requested = false;
+    std::atomic<bool> stop_requested = false;
+    std::atomic<bool> consumer_running = false;
+
+    std::atomic<uint32_t> high_water = 0;
+    std::atomic<uint32_t> overflows = 0;
+    std::atomic<uint32_t> dropped_bytes = 0; // 32-bit atomics are lock-free on the M0+, 64-bit ones are not
+    std::atomic<uint32_t> chunks_written = 0;
+    std::atomic<uint32_t> write_errors = 0;
+
+#ifdef PICO_SD_HOST
+    std::thread consumer;
+#else
+    static SDCardAsyncWriter* core1_writer;
+    static void Core1Entry();
+#endif
+
+    void Wake();
+    void Idle();
+    void Consume();
+    // Writes what the ring holds, whole chunks only unless all is set. Returns false on a card error.
+    bool Drain(bool all);
+
+public:
+    // ring_size and chunk_size must be powers of two, with chunk_size a multiple of the
+    // sector size and no more than half the ring, so one chunk can fill while another is written.
+    SDCardAsyncWriter(SDCard& card, void* ring, size_t ring_size, size_t chunk_size = FF_MIN_SS * 8);
+    ~SDCardAsyncWriter();
+
+    bool Open(const char* path, uint32_t access_mask = StorageDevice::WRITE | StorageDevice::OPEN_APPEND);
+    // Starts the consumer on core1, or on a thread on the host. Without it, call Service from a loop.
+    // Fails while core1 runs another worker, see SDCard::ClaimCore1.
+    bool Start();
+    // Stops the consumer after it has written everything pushed, then closes the file.
+    bool Close();
+
+    // Copies the whole record into the ring, or drops it and counts an overflow. Producer only.
+    bool Push(const void* data, size_t size);
+    // Asks the consumer to write out the partial chunk too and sync the file.
+    void RequestFlush();
+    // One pass of the consumer, for use without Start. Returns false on a card error.
+    bool Service();
+
+    Statistics GetStatistics() const;
+    void ResetStatistics();
+
+    inline size_t GetPending() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    inline bool IsOpen() const
+    {
+        return handle != SDCard::invalid_handle;
+    }
+
+    inline bool IsRunning() const
+    {
+        return consumer_running.load(std::memory_order_acquire);
+    }
+};
\ No newline at end of file
@@ -0,0 +1,88 @@
+#pragma once
+
+#include <stdint.h>
+
+// Decides the bus clock of a card from the outcome of its transfers. Nothing in here
+// touches hardware, so it can be driven by a simulated link as well as a real one.
+//
+// CRC errors or timeouts step the clock down once errors_to_step_down of them came without
+// a clean run of successes_to_step_up transfers in between. After such a run the clock
+// steps back up, towards max_hz. With min_hz, start_hz and max_hz all the same, the clock
+// stays put and only the counters move, for interfaces that cannot change it while running.
+// Every step down doubles the clean run needed before the next step up, so a clock that
+// keeps failing is retried less and less often.
+class SDCardClockPolicy
+{
+public:
+    struct Config
+    {
+        uint32_t min_hz;
+        uint32_t start_hz;
+        uint32_t max_hz;
+        uint32_t step_hz;
+        uint32_t errors_to_step_down;
+        uint32_t successes_to_step_up; // consecutive, before any back-off
+    };
+
+    struct Counters
+    {
+        uint32_t crc_errors;
+        uint32_t timeouts;
+        uint32_t other_errors;
+        uint32_t retries;
+        uint32_t step_ups;
+        uint32_t step_downs;
+    };
+
+    enum class Outcome
+    {
+        OK,
+        CRC_ERROR,
+        TIMEOUT,
+        OTHER_ERROR // not the link's fault, leaves the clock alone
+    };
+
+private:
+    static constexpr uint32_t max_backoff_shift = 8;
+
+    Config config;
+    uint32_t rate;
+    uint32_t recent_errors = 0; // since the last clean run
+    uint32_t consecutive_successes = 0;
+    uint32_t backoff_shift = 0;
+    Counters counters = {};
+
+public:
+    SDCardClockPolicy(const Config& config);
+
+    // Starts over from config.start_hz, forgetting what was learnt.
+    void Reset(const Config& config);
+
+    // Returns true when the clock should change to GetRate().
+    bool Record(Outcome outcome);
+
+    inline void RecordRetry()
+    {
+        counters.retries++;
+    }
+
+    inline uint32_t GetRate() const
+    {
+        return rate;
+    }
+
+    inline const Config& GetConfig() const
+    {
+        return config;
+    }
+
+    inline const Counters& GetCounters() const
+    {
+        return counters;
+    }
+
+    inline void ResetCounters()
+    {
+        counters = {};
+    }
+};
\ No newline at end of file
@@ -0,0 +1,50 @@
+#pragma once
+
+#include "SDCard.h"
+
+// Streams data into a file whose clusters were allocated up front and contiguously,
+// for high-rate capture. Whole sectors go straight to the card's block layer, with no
+// FatFs bookkeeping per write. The directory entry is only touched at checkpoints
+// and on Close, which trims the file to what was written and releases the rest.
+// The file occupies one slot of the card's file pool while open.
+class SDCardContiguousWriter
+{
+private:
+    SDCard* card;
+    SDCard::FileHandle handle = SDCard::invalid_handle;
+    LBA_t first_sector = 0;
+    uint64_t capacity = 0;
+    uint64_t written = 0;
+
+    alignas(4) uint8_t sector_buffer[FF_MIN_SS]; // the partial sector at the end of the data
+    size_t buffered = 0;
+
+    FIL& File();
+
+public:
+    SDCardContiguousWriter(SDCard& card);
+    ~SDCardContiguousWriter();
+
+    // Creates the file with bytes of contiguous space. Fails if the card has no run that long.
+    bool Open(const char* path, uint64_t bytes);
+    // Returns the bytes accepted, which is less than size once the preallocated space is full.
+    size_t Write(const void* data, size_t size);
+    // Records the data written so far in the directory entry, so it survives a power loss.
+    bool Checkpoint();
+    bool Close();
+
+    inline bool IsOpen() const
+    {
+        return handle != SDCard::invalid_handle;
+    }
+
+    inline uint64_t GetWritten() const
+    {
+        return written;
+    }
+
+    inline uint64_t GetCapacity() const
+    {
+        return capacity;
+    }
+};
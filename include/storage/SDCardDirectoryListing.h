@@ -0,0 +1,96 @@
+#pragma once
+
+#include "SDCard.h"
+
+// A page of a directory listing, packed into one block of memory: fixed-size entries grow
+// from the front, their names from the back, each stored once with its own length and
+// terminator. An entry costs at most 24 bytes plus its name instead of a whole
+// DirectoryEntry, so 2000 short names fit in about 64 KB, and listing them touches no more.
+// Fill it with SDCard::ListDirectory.
+class SDCardDirectoryListing
+{
+public:
+    struct Entry
+    {
+        FSIZE_t size;
+        uint32_t name_offset; // from the start of the memory
+        uint16_t name_length; // without the terminator
+        uint16_t date_modified;
+        uint16_t time_modified;
+        uint8_t attributes; // AM_*
+
+        inline bool IsDirectory() const
+        {
+            return attributes & AM_DIR;
+        }
+    };
+
+private:
+    std::unique_ptr<uint8_t[]> owned_memory;
+    uint8_t* memory;
+    size_t budget;
+
+    Entry* entries;
+    size_t count = 0;
+    size_t names_begin; // names take up memory[names_begin, budget)
+    size_t first = 0; // directory position of the first entry
+    bool more = false;
+
+    void Clear(size_t first);
+    // Stores info unless the entry and its name no longer fit.
+    bool Add(const FILINFO& info);
+
+public:
+    // Allocates the budget once, up front.
+    SDCardDirectoryListing(size_t budget);
+    // Lists into caller memory, for listings in static memory.
+    SDCardDirectoryListing(void* memory, size_t budget);
+
+    SDCardDirectoryListing(const SDCardDirectoryListing&) = delete;
+    SDCardDirectoryListing& operator=(const SDCardDirectoryListing&) = delete;
+
+    inline size_t GetCount() const
+    {
+        return count;
+    }
+
+    inline const Entry& GetEntry(size_t index) const
+    {
+        return entries[index];
+    }
+
+    inline const char* GetName(const Entry& entry) const
+    {
+        return (const char*)memory + entry.name_offset;
+    }
+
+    inline const char* GetName(size_t index) const
+    {
+        return GetName(entries[index]);
+    }
+
+    // Bytes of the budget in use, entries and names together.
+    inline size_t GetUsedBytes() const
+    {
+        return (uint8_t*)(entries + count) - memory + (budget - names_begin);
+    }
+
+    // Position of the first entry among those that passed the filter.
+    inline size_t GetFirst() const
+    {
+        return first;
+    }
+
+    // True when the directory goes on past this page; list again from GetNextOffset for the rest.
+    inline bool HasMore() const
+    {
+        return more;
+    }
+
+    inline size_t GetNextOffset() const
+    {
+        return first + count;
+    }
+
+    friend SDCard;
+};
\ No newline at end of file
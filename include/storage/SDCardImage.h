@@ -0,0 +1,108 @@
+#pragma once
+
+#include "SDCard.h"
+
+#include <stdio.h>
+
+// Host-only SDCard backed by a FAT image file. It registers through the same
+// sd_get_num()/sd_get_by_num() hooks as the hardware cards, so FatFs drives it
+// with the block-layer calls a real card would see. Each command can be charged
+// a latency and a transfer cost to model a particular card. Like the SPI driver,
+// a write that starts where the previous one ended continues the same multi-block
+// transfer and pays no command latency.
+class SDCardImage : public SDCard
+{
+public:
+    struct Timing
+    {
+        uint32_t command_latency_us = 0;
+        uint32_t read_bytes_per_sec = 0; // 0 is unlimited
+        uint32_t write_bytes_per_sec = 0; // 0 is unlimited
+        bool real_time = false; // actually sleep for the modelled time instead of only accounting it
+    };
+
+    // A simulated bus for exercising the clock policy. Above clean_up_to_hz, every
+    // error_every-th read or write fails before it reaches the image.
+    struct LinkModel
+    {
+        uint32_t clean_up_to_hz = 0; // 0 is clean at any rate
+        uint32_t error_every = 0; // 0 never fails
+        bool timeouts = false; // fail with no response instead of a CRC error
+    };
+
+    struct Statistics
+    {
+        uint64_t read_commands;
+        uint64_t write_commands;
+        uint64_t sync_commands;
+        uint64_t stop_commands; // multi-block writes ended, by a non-contiguous write, a read or a sync
+        uint64_t link_errors; // injected by the link model
+        uint64_t sectors_read;
+        uint64_t sectors_written;
+        uint64_t busy_us; // modelled time the card spent on commands
+    };
+
+private:
+    FILE* image;
+    const char* image_path;
+    uint64_t image_size;
+    Timing timing;
+    Statistics stats = {};
+    bool write_open = false;
+    uint64_t write_end = 0; // sector the open multi-block write continues at
+    LinkModel link;
+    uint32_t bus_hz = 0;
+    uint32_t link_transfers = 0;
+
+    static SDCardImage* FromCard(sd_card_t* sd_card_p);
+
+    static DSTATUS Init(sd_card_t* sd_card_p);
+    static void Deinit(sd_card_t* sd_card_p);
+    static block_dev_err_t ReadBlocks(sd_card_t* sd_card_p, uint8_t* buffer, uint64_t sector, uint32_t count);
+    static block_dev_err_t WriteBlocks(sd_card_t* sd_card_p, const uint8_t* buffer, uint64_t sector, uint32_t count);
+    static block_dev_err_t Sync(sd_card_t* sd_card_p);
+    static uint64_t GetNumSectors(sd_card_t* sd_card_p);
+
+    void ChargeCommand(uint64_t bytes, uint32_t bytes_per_sec);
+    void ChargeTransfer(uint64_t bytes, uint32_t bytes_per_sec, uint64_t us = 0);
+    void StopTransfer();
+    // The error the link model makes this transfer fail with, if any.
+    block_dev_err_t InjectLinkError();
+
+protected:
+    bool SetBusClock(uint32_t hz) override;
+
+public:
+    // If the image does not exist and image_size is non-zero, a blank image of that size is created.
+    SDCardImage(const char* image_path, uint64_t image_size = 0, const char* pc_name = "");
+    ~SDCardImage();
+
+    // Creates a fresh FAT volume on the image. The card must not be mounted.
+    bool Format();
+
+    inline void SetTiming(const Timing& timing)
+    {
+        this->timing = timing;
+    }
+
+    inline void SetLinkModel(const LinkModel& link)
+    {
+        this->link = link;
+    }
+
+    // The clock the card was last set to.
+    inline uint32_t GetLinkClock() const
+    {
+        return bus_hz;
+    }
+
+    inline const Statistics& GetStatistics() const
+    {
+        return stats;
+    }
+
+    inline void ResetStatistics()
+    {
+        stats = {};
+    }
+};
\ No newline at end of file
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "SDCard.h"
+
+#include <string_view>
+
+// Reads the open file of an SDCard line by line through a read-ahead window.
+// The card is only ever read forwards in window-sized pieces, so there are no
+// per-line seeks, and each line is handed out as a view into the window.
+// A line is valid until the next call to ReadLine.
+class SDCardLineReader
+{
+private:
+    SDCard* card;
+    std::unique_ptr<char[]> owned_window;
+    char* window;
+    size_t capacity;
+    size_t begin = 0; // unread bytes are window[begin, end)
+    size_t end = 0;
+    bool eof = false;
+    bool continued = false;
+
+public:
+    // Allocates its own window once, up front.
+    SDCardLineReader(SDCard& card, size_t window_size = FF_MIN_SS * 4);
+    // Uses caller memory for the window, for readers in static memory.
+    SDCardLineReader(SDCard& card, char* window, size_t window_size);
+
+    // Gets the next line without its line ending. A line longer than the window comes back
+    // in window-sized pieces, with IsLineContinued() true for every piece but the last.
+    bool ReadLine(std::string_view& line);
+
+    // Drops whatever is buffered. Call this after seeking the card or switching its file.
+    void Reset();
+
+    inline bool IsLineContinued() const
+    {
+        return continued;
+    }
+};
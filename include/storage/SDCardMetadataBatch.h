@@ -0,0 +1,84 @@
+#pragma once
+
+#include "SDCard.h"
+
+#ifndef PICO_SD_BATCH_SIZE
+#define PICO_SD_BATCH_SIZE 16
+#endif
+
+// Directory changes on one SDCard, queued and then applied in one go, like the renames,
+// deletes and new directories of a log rotation. Commit runs them in the order they were
+// queued, with the card's writes held in SDCardSectorCache, so the directory, FAT and
+// FSINFO sectors they share are written once at the end instead of after every change.
+//
+// The operations are not atomic together: a power cut during Commit may leave some of them
+// on the card and not others, and, as with the WRITE_BACK policy, some lost clusters.
+// Without the sector cache, Commit still works but writes everything as it goes.
+class SDCardMetadataBatch
+{
+public:
+    static constexpr size_t max_operations = PICO_SD_BATCH_SIZE;
+    static constexpr size_t path_space = 512; // shared by every path of a batch, terminators included
+
+    enum class Op : uint8_t
+    {
+        CREATE_DIRECTORY,
+        RENAME, // also moves
+        DELETE
+    };
+
+private:
+    struct Operation
+    {
+        Op op;
+        bool done; // set by Commit
+        uint16_t path; // offsets into paths
+        uint16_t new_path;
+    };
+
+    SDCard* card;
+    Operation operations[max_operations];
+    size_t count = 0;
+    char paths[path_space];
+    size_t paths_used = 0;
+
+    // Copies the paths, so the caller's buffers can be reused right away.
+    bool Queue(Op op, const char* path, const char* new_path = nullptr);
+    bool StorePath(const char* path, uint16_t& offset);
+
+public:
+    SDCardMetadataBatch(SDCard& card);
+
+    // Each returns false when the batch has no room left for the operation.
+    bool CreateDirectory(const char* dir_path);
+    bool Rename(const char* name, const char* new_name);
+    bool Move(const char* path, const char* new_path);
+    bool Delete(const char* path);
+
+    // Applies every queued operation, carrying on past the ones that fail, and syncs the card
+    // once. Returns true if all of them and the sync succeeded; GetResult tells them apart.
+    bool Commit();
+    // Empties the batch for the next round.
+    void Clear();
+
+    inline size_t GetCount() const
+    {
+        return count;
+    }
+
+    inline Op GetOp(size_t index) const
+    {
+        return operations[index].op;
+    }
+
+    inline const char* GetPath(size_t index) const
+    {
+        return paths + operations[index].path;
+    }
+
+    // Whether the operation succeeded in the last Commit.
+    inline bool GetResult(size_t index) const
+    {
+        return operations[index].done;
+    }
+};
\ No newline at end of file
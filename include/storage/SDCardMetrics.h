@@ -0,0 +1,189 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// PICO_SD_METRICS 0 compiles the instrumentation out: nothing is counted or timed, and
+// snapshots read as all zero. Enabled, it costs about 2.5 KB per card.
+#ifndef PICO_SD_METRICS
+#define PICO_SD_METRICS 1
+#endif
+
+// Per-operation counters and latency histograms of one SDCard. Every instrumented call is
+// timed from entry to return, and whatever happened underneath meanwhile, sectors at the
+// block layer and f_lseek calls, is charged to it. Calls made from inside another call
+// count for both, so ReadLine includes the FindPreviousCharacter it starts with.
+//
+// Latencies go into power-of-two buckets of microseconds: bucket 0 holds calls under 1 us,
+// bucket i those from 2^(i-1) up to 2^i us, and the last one everything longer.
+class SDCardMetrics
+{
+public:
+    enum Operation : uint8_t
+    {
+        OP_MOUNT,
+        OP_UNMOUNT,
+        OP_OPEN,
+        OP_CLOSE,
+        OP_READ,
+        OP_READ_LINE,
+        OP_WRITE,
+        OP_APPEND,
+        OP_SEEK,
+        OP_FLUSH,
+        OP_FIND_NEXT,
+        OP_FIND_PREVIOUS,
+        OP_CLEAR,
+        OP_STAT, // every stat query, cached or not
+        OP_DIRECTORY, // listings, counts and summaries
+        OP_CHANGE_DIRECTORY,
+        OP_CREATE_DIRECTORY,
+        OP_RENAME,
+        OP_DELETE,
+        OP_FREE_SPACE,
+        // single commands at the block layer, underneath FatFs
+        OP_BLOCK_READ,
+        OP_BLOCK_WRITE,
+        OP_BLOCK_SYNC,
+        OP_COUNT
+    };
+
+    static constexpr size_t bucket_count = 20;
+
+    struct OperationStats
+    {
+        uint32_t calls;
+        uint32_t max_us;
+        uint64_t total_us;
+        uint64_t bytes; // moved by the caller's reads and writes, or by block commands
+        uint32_t sectors_read;
+        uint32_t sectors_written;
+        uint32_t seeks;
+        uint32_t buckets[bucket_count];
+
+        // Upper end of the bucket the given percentile of calls falls in, at most max_us.
+        uint32_t Percentile(uint32_t percent) const;
+    };
+
+    struct Data
+    {
+        OperationStats operations[OP_COUNT];
+
+        // totals
+        uint32_t read_commands;
+        uint32_t sectors_read;
+        uint32_t write_commands;
+        uint32_t sectors_written;
+        uint32_t sync_commands;
+        uint32_t seeks;
+    };
+
+    // Gets one line of the dump at a time, newline included.
+    using LineWriter = void (*)(const char* line, void* user_data);
+
+    // Times one call and charges it what happened underneath until the scope ends.
+    class Scope
+    {
+#if PICO_SD_METRICS
+    private:
+        SDCardMetrics& metrics;
+        Operation op;
+        uint32_t start;
+        uint32_t sectors_read;
+        uint32_t sectors_written;
+        uint32_t seeks;
+        uint64_t bytes = 0;
+
+    public:
+        Scope(SDCardMetrics& metrics, Operation op);
+        ~Scope();
+
+        inline void AddBytes(uint64_t bytes)
+        {
+            this->bytes += bytes;
+        }
+#else
+    public:
+        inline Scope(SDCardMetrics&, Operation)
+        {
+        }
+
+        inline void AddBytes(uint64_t)
+        {
+        }
+#endif
+    };
+
+private:
+#if PICO_SD_METRICS
+    Data data = {};
+#endif
+
+public:
+    static const char* GetName(Operation op);
+
+    // Writes a header, one line per operation that was called, and the totals, in columns
+    // separated by spaces: name calls bytes p50_us p99_us max_us avg_us sectors_read sectors_written seeks.
+    static void Dump(const Data& data, LineWriter writer, void* user_data = nullptr);
+
+#if PICO_SD_METRICS
+    inline void CountRead(uint32_t sectors)
+    {
+        data.read_commands++;
+        data.sectors_read += sectors;
+    }
+
+    inline void CountWrite(uint32_t sectors)
+    {
+        data.write_commands++;
+        data.sectors_written += sectors;
+    }
+
+    inline void CountSync()
+    {
+        data.sync_commands++;
+    }
+
+    inline void CountSeek()
+    {
+        data.seeks++;
+    }
+
+    inline void Snapshot(Data& out) const
+    {
+        out = data;
+    }
+
+    inline void Reset()
+    {
+        data = {};
+    }
+#else
+    inline void CountRead(uint32_t)
+    {
+    }
+
+    inline void CountWrite(uint32_t)
+    {
+    }
+
+    inline void CountSync()
+    {
+    }
+
+    inline void CountSeek()
+    {
+    }
+
+    inline void Snapshot(Data& out) const
+    {
+        out = {};
+    }
+
+    inline void Reset()
+    {
+    }
+#endif
+
+    void Dump(LineWriter writer, void* user_data = nullptr) const;
+};
\ No newline at end of file
@@ -0,0 +1,125 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <memory>
+
+#include <ff.h>
+
+// Hash index of the names in one directory, so lookups in directories of thousands of
+// entries do not have FatFs compare every one of them. Each name keeps a 32-bit hash and
+// the position of its directory entry, 6 bytes a slot at a load of at most 3/4, plus one
+// cluster number per cluster of the directory. The index is built by one pass over the
+// directory on the first lookup after it was enabled or invalidated. Names created since
+// are known to be there but not where, so their lookups go to f_stat; after
+// fallbacks_to_rebuild of those the next lookup builds the index again.
+//
+// A found hash is checked by reading the directory entry at its position, which touches
+// one sector rather than the directory up to that point, and a missing hash means the
+// name is not there without reading anything. Names are compared ignoring ASCII case like
+// FatFs does; names it cannot answer for exactly, with bytes outside ASCII, a '~' that may
+// belong to a short name alias, or trailing dots and spaces, are left to FatFs.
+class SDCardNameIndex
+{
+public:
+    static constexpr size_t path_length = 64;
+
+    enum class Result
+    {
+        ABSENT,
+        FOUND,
+        UNKNOWN // ask FatFs
+    };
+
+    struct Counters
+    {
+        uint32_t builds;
+        uint32_t found;
+        uint32_t absent; // answered without touching the card
+        uint32_t unknown;
+    };
+
+private:
+    static constexpr uint32_t empty_hash = 0;
+    static constexpr uint32_t removed_hash = 1;
+    static constexpr uint16_t unknown_entry = 0xFFFF; // created since the last build
+    static constexpr size_t min_capacity = 64;
+    static constexpr uint32_t fallbacks_to_rebuild = 8; // lookups left to FatFs before the next build
+
+    char path[path_length] = {};
+    bool enabled = false;
+    bool built = false;
+
+    // Open addressing, linear probing. An entry is the offset of the directory entry / 32.
+    std::unique_ptr<uint32_t[]> hashes;
+    std::unique_ptr<uint16_t[]> entries;
+    size_t capacity = 0;
+    size_t used = 0; // including removed slots
+    uint32_t fallbacks = 0; // since the last build
+
+    // Cluster of every cluster-sized piece of the directory, 0 where unknown.
+    std::unique_ptr<DWORD[]> clusters;
+    size_t cluster_count = 0;
+    DWORD cluster_bytes = 0;
+    bool static_root = false; // FAT12/16 root directory, a fixed run of sectors
+
+    Counters counters = {};
+
+    static uint32_t Hash(const char* name);
+    static bool NamesEqual(const char* a, const char* b);
+
+    bool Build();
+    void Grow(size_t new_capacity);
+    void Insert(uint32_t hash, uint16_t entry);
+    void AddCluster(DWORD position, DWORD cluster);
+    // Reads the first entry at or after entry, the way f_readdir would.
+    bool ReadAt(uint16_t entry, FILINFO& info) const;
+    bool Usable();
+
+public:
+    // Whether a lookup of name can be answered from an index at all.
+    static bool IsIndexable(const char* name);
+    // Where path goes on after the parts of prefix, or nullptr when it does not start with them.
+    // Parts compare like FatFs resolves them: '/', '\\' and runs of them are alike, and so is ASCII case.
+    static const char* SkipParts(const char* path, size_t path_length, const char* prefix, size_t prefix_length);
+
+    // Starts indexing dir_path. Invalidate goes on.
+    bool Enable(const char* dir_path);
+    // Frees the index.
+    void Disable();
+
+    // Drops what was learnt, the next lookup builds the index again.
+    inline void Invalidate()
+    {
+        built = false;
+    }
+
+    inline bool IsEnabled() const
+    {
+        return enabled;
+    }
+
+    inline const char* GetPath() const
+    {
+        return path;
+    }
+
+    Result Lookup(const char* name, FILINFO& info);
+    // False when name is surely not there. Reads nothing but the table.
+    bool MayContain(const char* name);
+
+    // The directory changed through these names.
+    void Added(const char* name);
+    void Removed(const char* name);
+
+    inline const Counters& GetCounters() const
+    {
+        return counters;
+    }
+
+    inline void ResetCounters()
+    {
+        counters = {};
+    }
+};
\ No newline at end of file
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "SDCard.h"
+
+// An append-only log of keyed records, for telemetry and the like. Keys are usually
+// timestamps and must not go down. Records are length-prefixed and checksummed, and never
+// span blocks; blocks are one sector each and carry their position and first key.
+//
+// The file starts with a header sector and two tail slots, followed by the full blocks.
+// A full block is written once, after the last one. The block still being filled is only
+// ever written by Flush, into the tail slot that does not hold its last flushed copy, so
+// a write torn by a power loss leaves the other slot and every full block as they were.
+//
+// Every index_interval-th block is also listed in a side file, <path>.idx, so Seek finds
+// a key with a binary search of the index and then of at most index_interval block
+// headers, instead of scanning the log. Opening an existing log recovers it from the end:
+// full blocks that did not make it are cut off, the open block comes back from the tail
+// slot that holds more of it, cut back to its last record that checks out, and the index
+// is brought up to date from the block headers it is missing. Open fails instead, leaving
+// the files alone, when the card cannot be read or the file does not start with the
+// header of a log.
+//
+// Uses two slots of the card's file pool while open.
+class SDCardRecordLog
+{
+public:
+    static constexpr size_t block_size = FF_MIN_SS;
+    static constexpr size_t max_path_length = 96;
+
+    struct RecoveryReport
+    {
+        uint32_t blocks_checked;
+        uint32_t blocks_dropped; // torn full blocks cut off the end
+        uint32_t records_dropped; // records with a bad checksum in the open block
+        uint32_t index_entries_rebuilt;
+    };
+
+private:
+    struct LogHeader
+    {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t block_size;
+        uint32_t crc; // of the fields before it
+    };
+
+    struct BlockHeader
+    {
+        uint32_t magic;
+        uint32_t block; // its own position, so stale sectors are told apart
+        uint64_t first_key;
+        uint16_t used; // bytes of records after the header
+        uint16_t record_count;
+        uint32_t crc; // of the header, with this field zeroed
+    };
+
+    struct RecordHeader
+    {
+        uint64_t key;
+        uint32_t crc; // of the key, the length and the payload
+        uint16_t length;
+        uint16_t reserved;
+    };
+
+    struct IndexEntry
+    {
+        uint64_t first_key;
+        uint32_t block;
+        uint32_t crc;
+    };
+
+    static constexpr uint32_t log_magic = 0x464C5253; // "SRLF"
+    static constexpr uint32_t log_version = 1;
+    static constexpr uint32_t block_magic = 0x474C5253; // "SRLG"
+    static constexpr uint32_t tail_slots = 2;
+    static constexpr uint64_t data_offset = (1 + tail_slots) * block_size; // where block 0 starts
+
+    enum class Check : uint8_t
+    {
+        VALID,
+        DAMAGED, // read fine, but the magic, position or a checksum is wrong
+        READ_FAILED
+    };
+
+public:
+    static constexpr size_t max_record_size = block_size - sizeof(BlockHeader) - sizeof(RecordHeader);
+
+private:
+    SDCard* card;
+    uint32_t index_interval;
+    SDCard::FileHandle data_handle = SDCard::invalid_handle;
+    SDCard::FileHandle index_handle = SDCard::invalid_handle;
+    char data_path[max_path_length + 1];
+    char index_path[max_path_length + 5];
+
+    // The block being appended to, after the full ones. Flush copies it into a tail slot,
+    // filling up writes it to its place.
+    alignas(8) uint8_t write_block[block_size];
+    uint32_t block_count = 0; // full blocks in the file
+    uint32_t write_block_number = 0;
+    uint32_t index_entries = 0;
+    uint64_t last_key = 0;
+    bool has_records = false;
+    bool write_block_open = false; // write_block holds block write_block_number
+    bool write_block_dirty = false; // with records the tail slots do not have yet
+    uint8_t tail_slot = 0; // the one the next Flush writes, never the one it wrote last
+
+    // Read cursor.
+    alignas(8) uint8_t read_block[block_size];
+    uint32_t read_block_number = UINT32_MAX; // which block read_block holds
+    uint32_t cursor_block = 0;
+    uint16_t cursor_offset = 0;
+
+    RecoveryReport recovery = {};
+
+    static uint32_t Crc32(const void* data, size_t size, uint32_t crc = 0);
+    static bool HeaderValid(const BlockHeader& header, uint32_t block);
+    static uint32_t HeaderCrc(BlockHeader header);
+    static uint32_t RecordCrc(const RecordHeader& header, const uint8_t* payload);
+    static uint32_t IndexCrc(const IndexEntry& entry);
+    static uint64_t LastKey(const uint8_t* block);
+
+    // Writes the header and empty tail slots over whatever of them a file size bytes long lacks.
+    bool Initialise(uint64_t size);
+    BlockHeader& WriteHeader();
+    void StartBlock(uint32_t number, uint64_t first_key);
+    bool WriteBlock(uint64_t offset);
+    // Writes the open block to its place after the last full one, making it full.
+    bool CloseBlock();
+    // Writes the open block to a tail slot.
+    bool WriteTail();
+    // Reads the sector at offset into read_block and checks that it is block number.
+    Check ReadBlock(uint64_t offset, uint32_t number);
+    // Loads a block into read_block, or points at write_block for the open one.
+    const uint8_t* LoadBlock(uint32_t number);
+    // LoadBlock and ReadIndex, telling a failed read apart from data that does not check out.
+    Check CheckBlock(uint32_t number, const uint8_t*& block);
+    bool ReadIndex(uint32_t entry, IndexEntry& out);
+    Check CheckIndex(uint32_t entry, IndexEntry& out);
+    bool AppendIndex(uint64_t first_key, uint32_t block);
+    // Returns the bytes taken by the records that check out, up to the first one that does not.
+    uint16_t ValidRecordBytes(const uint8_t* block, uint16_t& count);
+    bool Recover();
+
+public:
+    SDCardRecordLog(SDCard& card, uint32_t index_interval = 16);
+    ~SDCardRecordLog();
+
+    // Opens or creates the log and its index, recovering them if they were left inconsistent.
+    bool Open(const char* path);
+    bool Close();
+
+    // The key must not be lower than the last one. length is at most max_record_size.
+    bool Append(uint64_t key, const void* data, uint16_t length);
+    // Writes out the open block and syncs both files. Records appended before it survive a power loss.
+    bool Flush();
+
+    // Moves the read cursor to the first record whose key is at least key.
+    bool Seek(uint64_t key);
+    bool SeekStart();
+    // Reads the record at the cursor and advances. A payload longer than buffer_size is cut short,
+    // length still tells the full size. Returns false at the end of the log.
+    bool Next(uint64_t& key, void* buffer, size_t buffer_size, uint16_t& length);
+
+    inline bool IsOpen() const
+    {
+        return data_handle != SDCard::invalid_handle;
+    }
+
+    inline uint64_t GetLastKey() const
+    {
+        return last_key;
+    }
+
+    inline bool IsEmpty() const
+    {
+        return !has_records;
+    }
+
+    inline uint32_t GetBlockCount() const
+    {
+        return write_block_open ? write_block_number + 1 : block_count;
+    }
+
+    inline const RecoveryReport& GetRecoveryReport() const
+    {
+        return recovery;
+    }
+};
\ No newline at end of file
@@ -13,12 +13,20 @@ public:
         const uint8_t cs_pin;
     };
 
-    static constexpr uint32_t baud_rate = 125 * 1000 * 1000 / 4;
+    static constexpr uint32_t baud_rate = 125 * 1000 * 1000 / 4; // the fastest the clock goes
+    static constexpr uint32_t start_baud_rate = 125 * 1000 * 1000 / 6; // where it starts, one divider down
+    static constexpr uint32_t min_baud_rate = 1000 * 1000;
 
 private:
     sd_spi_if_t card_interface;
     spi_t spi;
 
+    void ConfigureClock();
+
+protected:
+    // SPI is clocked by the host, so the new rate applies from the next transfer on.
+    bool SetBusClock(uint32_t hz) override;
+
 public:
     SDCardSPI(const SDCardSPI::Pinout& pins, spi_inst_t* spi_inst = spi0, const char* pc_name = "");
     SDCardSPI(uint8_t clk_pin, uint8_t mosi_pin, uint8_t miso_pin, uint8_t cs_pin, spi_inst_t* spi_inst = spi0, const char* pc_name = "");
@@ -0,0 +1,111 @@
+#pragma once
+
+#include "SDCard.h"
+
+#ifndef PICO_SD_SECTOR_CACHE_SIZE
+#define PICO_SD_SECTOR_CACHE_SIZE 8
+#endif
+
+// A sector cache shared by every SDCard, between FatFs and each card's block layer.
+// FatFs keeps a single sector window per volume and per file, so walking FAT chains and
+// directories reads the same few sectors again and again; those now come from RAM.
+//
+// Mount puts the cache in front of the card by swapping the read_blocks, write_blocks and
+// sync pointers of its sd_card_t, so everything that goes through the block layer, FatFs
+// and SDCard::ReadSectors alike, is cached. Only single-sector transfers are kept. Longer
+// ones are file data and pass straight through, patched with any cached sectors they overlap.
+// Eviction is least recently used, except that FAT sectors (everything before the data
+// area) are kept longer than others.
+//
+// With WRITE_BACK, single-sector writes stay in the cache until the sector is evicted or
+// the card is synced, which FatFs does on every f_sync and f_close. HoldWrites does the
+// same for a single card whatever the policy, and also turns its syncs into no-ops until
+// ReleaseWrites, for a run of FatFs calls that would each sync the same sectors.
+//
+// Cards transferring on both cores at once, as in SDCardArray, share it safely: multi-sector
+// transfers run outside the cache's lock, and a card only ever writes back its own sectors.
+//
+// PICO_SD_SECTOR_CACHE_SIZE sets the number of sectors; 0 leaves the cache out.
+class SDCardSectorCache
+{
+public:
+    static constexpr size_t size = PICO_SD_SECTOR_CACHE_SIZE;
+
+    enum class Policy
+    {
+        WRITE_THROUGH,
+        WRITE_BACK
+    };
+
+    struct Statistics
+    {
+        uint32_t hits;
+        uint32_t misses;
+        uint32_t bypassed; // multi-sector transfers, never cached
+        uint32_t evictions;
+        uint32_t write_backs;
+    };
+
+private:
+    struct Entry
+    {
+        alignas(4) uint8_t data[FF_MIN_SS];
+        sd_card_t* card;
+        uint64_t sector;
+        uint32_t last_used;
+        bool valid;
+        bool dirty;
+        bool is_fat; // kept longer on eviction
+    };
+
+    static Entry entries[size ? size : 1];
+    static uint32_t clock;
+    static Policy policy;
+    static Statistics stats;
+
+    static SDCard* Owner(sd_card_t* sd_card_p);
+    static Entry* Find(sd_card_t* sd_card_p, uint64_t sector);
+    // Picks an entry for the sector, writing back what it held if needed.
+    // nullptr if that failed or everything cached is another card's unwritten data.
+    static Entry* Allocate(SDCard* owner, uint64_t sector);
+    static bool WriteBack(Entry& entry);
+
+    static block_dev_err_t ReadBlocks(sd_card_t* sd_card_p, uint8_t* buffer, uint64_t sector, uint32_t count);
+    static block_dev_err_t WriteBlocks(sd_card_t* sd_card_p, const uint8_t* buffer, uint64_t sector, uint32_t count);
+    static block_dev_err_t Sync(sd_card_t* sd_card_p);
+
+public:
+    // Called by SDCard on Mount and Unmount. Detach writes back and forgets the card's sectors.
+    static void Attach(SDCard* card);
+    static void Detach(SDCard* card);
+
+    // Writes back dirty sectors of one card, or of all of them when card is nullptr.
+    static bool Flush(SDCard* card = nullptr);
+    // Forgets a card's sectors without writing them, for when the card was pulled or swapped.
+    static void Invalidate(SDCard* card);
+
+    // Nesting is not supported. Release writes back what was held and syncs the card.
+    static void HoldWrites(SDCard* card);
+    static bool ReleaseWrites(SDCard* card);
+
+    // Switching to WRITE_THROUGH writes back everything dirty first.
+    static bool SetPolicy(Policy policy);
+
+    static inline Policy GetPolicy()
+    {
+        return policy;
+    }
+
+    static inline Statistics GetStatistics()
+    {
+        return stats;
+    }
+
+    static inline void ResetStatistics()
+    {
+        stats = {};
+    }
+
+    // Share of single-sector reads served from the cache, 0 to 1.
+    static float GetHitRate();
+};
\ No newline at end of file
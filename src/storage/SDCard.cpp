@@ -1,9 +1,58 @@
 #include <storage/SDCard.h>
+#include <storage/SDCardDirectoryListing.h>
+#include <storage/SDCardSectorCache.h>
+
+#include "SDCardTime.h"
 
 #include <algorithm>
+#include <type_traits>
+
+#ifdef PICO_SD_HOST
+#include <mutex>
+
+static std::mutex core1_mutex;
+#else
+#include <hardware/timer.h>
+#include <pico/critical_section.h>
+#include <pico/mutex.h>
+
+auto_init_mutex(core1_mutex);
+#endif
 
 std::vector<SDCard*> SDCard::_insts = std::vector<SDCard*>();
 
+static const void* core1_owner = nullptr;
+
+bool SDCard::ClaimCore1(const void* owner)
+{
+#ifdef PICO_SD_HOST
+    std::lock_guard<std::mutex> lock(core1_mutex);
+#else
+    mutex_enter_blocking(&core1_mutex);
+#endif
+    bool claimed = !core1_owner || core1_owner == owner;
+    if (claimed)
+        core1_owner = owner;
+#ifndef PICO_SD_HOST
+    mutex_exit(&core1_mutex);
+#endif
+    return claimed;
+}
+
+void SDCard::ReleaseCore1(const void* owner)
+{
+#ifdef PICO_SD_HOST
+    std::lock_guard<std::mutex> lock(core1_mutex);
+#else
+    mutex_enter_blocking(&core1_mutex);
+#endif
+    if (core1_owner == owner)
+        core1_owner = nullptr;
+#ifndef PICO_SD_HOST
+    mutex_exit(&core1_mutex);
+#endif
+}
+
 DirectoryEntry SDCard::GetEntryFromFatFsStat(const FILINFO& info)
 {
     DirectoryEntry entry;
@@ -19,6 +68,12 @@ DirectoryEntry SDCard::GetEntryFromFatFsStat(const FILINFO& info)
     return entry;
 }
 
+// Opening for reading changes nothing a stat would see.
+static bool MayChangeFile(BYTE mode)
+{
+    return mode & (FA_WRITE | FA_CREATE_ALWAYS | FA_OPEN_ALWAYS | FA_CREATE_NEW);
+}
+
 uint32_t SDCard::TranslateFileAccessFlags(uint32_t access)
 {
     uint32_t mask = 0;
@@ -39,8 +94,625 @@ uint32_t SDCard::TranslateFileAccessFlags(uint32_t access)
     return mask;
 }
 
+bool SDCard::MatchesFilter(const FILINFO& info, const DirectoryFilter& filter)
+{
+    if ((info.fattrib & filter.required_attributes) != filter.required_attributes)
+        return false;
+    if (info.fattrib & filter.excluded_attributes)
+        return false;
+    return !filter.name_pattern || MatchPattern(filter.name_pattern, info.fname);
+}
+
+bool SDCard::MatchPattern(const char* pattern, const char* name)
+{
+    // iterative wildcard match, backtracking to the last '*' on a mismatch
+    const char* star = nullptr;
+    const char* star_name = nullptr;
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            star = pattern++;
+            star_name = name;
+        }
+        else if (*pattern == '?' || tolower((unsigned char)*pattern) == tolower((unsigned char)*name))
+        {
+            pattern++;
+            name++;
+        }
+        else if (star)
+        {
+            pattern = star + 1;
+            name = ++star_name;
+        }
+        else
+            return false;
+    }
+    while (*pattern == '*')
+        pattern++;
+    return *pattern == 0;
+}
+
+const uint8_t* SDCard::FindInBlock(const uint8_t* block, size_t size, const uint8_t* pattern, size_t length)
+{
+    if (size < length)
+        return nullptr;
+
+    const uint8_t* last = block + (size - length); // last position a full match can start at
+    const uint8_t* p = block;
+    while (p <= last)
+    {
+        p = (const uint8_t*)memchr(p, pattern[0], last - p + 1);
+        if (!p)
+            return nullptr;
+        if (memcmp(p + 1, pattern + 1, length - 1) == 0)
+            return p;
+        p++;
+    }
+    return nullptr;
+}
+
+int64_t SDCard::ScanForward(const void* pattern, size_t length, uint64_t start)
+{
+    uint64_t size = f_size(&active->file);
+    if (length == 0 || start + length > size)
+        return -1;
+
+    // The last length - 1 bytes of each block are carried over so matches across block edges are found.
+    // Patterns too long for that to fit in the scratch block get a larger one from the heap.
+    uint8_t* buff = block_buffer;
+    size_t capacity = block_buffer_size;
+    std::unique_ptr<uint8_t[]> large_buff;
+    if (length > capacity / 2)
+    {
+        capacity = (length * 2 + FF_MIN_SS - 1) / FF_MIN_SS * FF_MIN_SS;
+        large_buff = std::make_unique<uint8_t[]>(capacity);
+        buff = large_buff.get();
+    }
+
+    if (Lseek(&active->file, start) != FR_OK)
+        return -1;
+
+    uint64_t buff_pos = start; // file offset of buff[0]
+    size_t filled = 0;
+    while (1)
+    {
+        // end every read on a sector boundary so FatFs can transfer whole sectors straight into buff
+        size_t to_read = capacity - filled;
+        size_t misalignment = (buff_pos + filled + to_read) % FF_MIN_SS;
+        if (to_read > misalignment)
+            to_read -= misalignment;
+
+        UINT bytes_read;
+        if (f_read(&active->file, buff + filled, to_read, &bytes_read) != FR_OK)
+            return -1;
+        filled += bytes_read;
+
+        const uint8_t* match = FindInBlock(buff, filled, (const uint8_t*)pattern, length);
+        if (match)
+            return buff_pos + (match - buff);
+
+        if (bytes_read == 0)
+            return -1; // end of file
+
+        size_t carry = filled < length - 1 ? filled : length - 1;
+        memmove(buff, buff + filled - carry, carry);
+        buff_pos += filled - carry;
+        filled = carry;
+    }
+}
+
+int64_t SDCard::FindNext(const void* pattern, size_t length, bool keep_index)
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_FIND_NEXT);
+    if (is_file_open)
+    {
+        EndStream();
+        FlushWriteBuffer();
+        uint64_t loc = f_tell(&active->file);
+        int64_t found = ScanForward(pattern, length, loc + 1); // the match at the current position is not the next one
+
+        if (keep_index)
+            Lseek(&active->file, loc);
+        else if (found < 0)
+            Lseek(&active->file, f_size(&active->file));
+        else
+            Lseek(&active->file, found);
+        return found;
+    }
+    return -1;
+}
+
+const uint8_t* SDCard::FindLastInBlock(const uint8_t* block, size_t size, const uint8_t* pattern, size_t length)
+{
+    if (size < length)
+        return nullptr;
+
+    for (const uint8_t* p = block + (size - length); p >= block; p--)
+    {
+        if (*p == pattern[0] && memcmp(p + 1, pattern + 1, length - 1) == 0)
+            return p;
+    }
+    return nullptr;
+}
+
+int64_t SDCard::ScanBackward(const void* pattern, size_t length, uint64_t before, size_t occurrence)
+{
+    uint64_t size = f_size(&active->file);
+    if (length == 0 || before == 0 || occurrence == 0)
+        return -1;
+
+    // a match may start anywhere before the offset and run on past it
+    uint64_t region_end = before - 1 + length;
+    region_end = region_end > size ? size : region_end;
+    if (region_end < length)
+        return -1;
+
+    uint8_t* buff = block_buffer;
+    size_t capacity = block_buffer_size;
+    std::unique_ptr<uint8_t[]> large_buff;
+    if (length > capacity / 2)
+    {
+        capacity = (length * 2 + FF_MIN_SS - 1) / FF_MIN_SS * FF_MIN_SS;
+        large_buff = std::make_unique<uint8_t[]>(capacity);
+        buff = large_buff.get();
+    }
+
+    // Each block is read in front of the first length - 1 bytes of the block after it,
+    // so matches across block edges are found.
+    uint64_t data_end = region_end; // file offset the next read stops at
+    size_t carry = 0;
+    while (1)
+    {
+        // start every read on a sector boundary so FatFs can transfer whole sectors straight into buff
+        size_t to_read = capacity - carry;
+        uint64_t read_pos = data_end > to_read ? data_end - to_read : 0;
+        uint64_t aligned_pos = (read_pos + FF_MIN_SS - 1) / FF_MIN_SS * FF_MIN_SS;
+        if (read_pos != 0 && aligned_pos < data_end)
+            read_pos = aligned_pos;
+        to_read = data_end - read_pos;
+
+        memmove(buff + to_read, buff, carry);
+
+        UINT bytes_read;
+        if (Lseek(&active->file, read_pos) != FR_OK || f_read(&active->file, buff, to_read, &bytes_read) != FR_OK || bytes_read != to_read)
+            return -1;
+        size_t filled = to_read + carry;
+
+        const uint8_t* match = FindLastInBlock(buff, filled, (const uint8_t*)pattern, length);
+        while (match)
+        {
+            if (--occurrence == 0)
+                return read_pos + (match - buff);
+            // keep looking for earlier ones in the same block
+            match = FindLastInBlock(buff, (match - buff) + length - 1, (const uint8_t*)pattern, length);
+        }
+
+        if (read_pos == 0)
+            return -1; // start of file
+
+        carry = filled < length - 1 ? filled : length - 1;
+        data_end = read_pos;
+    }
+}
+
+int64_t SDCard::FindPrevious(const void* pattern, size_t length, bool keep_index)
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_FIND_PREVIOUS);
+    if (is_file_open)
+    {
+        EndStream();
+        FlushWriteBuffer();
+        uint64_t loc = f_tell(&active->file);
+        int64_t found = ScanBackward(pattern, length, loc);
+
+        if (keep_index)
+            Lseek(&active->file, loc);
+        else if (found < 0)
+            Lseek(&active->file, 0);
+        else
+            Lseek(&active->file, found);
+        return found;
+    }
+    return -1;
+}
+
+size_t SDCard::WriteData(const void* data, size_t size)
+{
+    UINT bytes_written;
+    if (!active->write_buffer)
+    {
+        f_write(&active->file, data, size, &bytes_written);
+        return bytes_written;
+    }
+
+    const uint8_t* src = (const uint8_t*)data;
+    size_t remaining = size;
+    while (remaining)
+    {
+        if (active->write_buffered == 0 && remaining >= active->write_buffer_size)
+        {
+            // Large enough to go straight to FatFs. Stop on a sector boundary and buffer the rest,
+            // so the next small write does not start with a partial sector.
+            uint64_t pos = f_tell(&active->file);
+            uint64_t aligned_end = (pos + remaining) / FF_MIN_SS * FF_MIN_SS;
+            if (aligned_end > pos)
+            {
+                size_t direct = aligned_end - pos;
+                f_write(&active->file, src, direct, &bytes_written);
+                src += bytes_written;
+                remaining -= bytes_written;
+                if (bytes_written != direct)
+                    break;
+                continue;
+            }
+        }
+
+        size_t n = active->write_buffer_size - active->write_buffered;
+        n = remaining < n ? remaining : n;
+        memcpy(active->write_buffer + active->write_buffered, src, n);
+        active->write_buffered += n;
+        src += n;
+        remaining -= n;
+
+        if (active->write_buffered == active->write_buffer_size && !DrainWriteBuffer(false))
+            break;
+    }
+    return size - remaining;
+}
+
+bool SDCard::DrainWriteBuffer(bool all)
+{
+    if (active->write_buffered == 0)
+        return true;
+
+    // keep the tail past the last sector boundary unless everything has to go out
+    size_t to_write = active->write_buffered;
+    if (!all)
+    {
+        uint64_t pos = f_tell(&active->file);
+        uint64_t aligned_end = (pos + active->write_buffered) / FF_MIN_SS * FF_MIN_SS;
+        if (aligned_end > pos)
+            to_write = aligned_end - pos;
+    }
+
+    UINT bytes_written;
+    FRESULT result = f_write(&active->file, active->write_buffer, to_write, &bytes_written);
+    active->write_buffered -= bytes_written;
+    memmove(active->write_buffer, active->write_buffer + bytes_written, active->write_buffered);
+    return result == FR_OK && bytes_written == to_write;
+}
+
+bool SDCard::FlushWriteBuffer()
+{
+    return DrainWriteBuffer(true);
+}
+
+bool SDCard::SetWriteBuffer(void* buffer, size_t size)
+{
+    if (is_file_open && !FlushWriteBuffer())
+        return false;
+
+    active->write_buffer = (uint8_t*)buffer;
+    active->write_buffer_size = buffer ? size : 0;
+    active->write_buffered = 0;
+    return true;
+}
+
+bool SDCard::Flush()
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_FLUSH);
+    if (is_file_open)
+    {
+        EndStream();
+        bool flushed = FlushWriteBuffer();
+        bool synced = f_sync(&active->file) == FR_OK;
+        if (active->file.flag & FA_WRITE)
+            InvalidateStatCache();
+        return synced && flushed;
+    }
+    return false;
+}
+
+FRESULT SDCard::CachedStat(const char* path, FILINFO* info) const
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_STAT);
+    size_t len = strlen(path);
+    if (stat_cache_size == 0 || len >= stat_cache_path_length)
+        return IndexedStat(path, info);
+
+    StatCacheEntry* victim = &stat_cache[0];
+    for (StatCacheEntry& entry : stat_cache)
+    {
+        if (entry.valid && strcmp(entry.path, path) == 0)
+        {
+            stat_cache_counters.hits++;
+            entry.last_used = ++stat_cache_clock;
+            *info = entry.info;
+            return entry.result;
+        }
+
+        if (!entry.valid || (victim->valid && entry.last_used < victim->last_used))
+            victim = &entry;
+    }
+
+    // misses are cached as well, polling for a file that is not there is just as common
+    stat_cache_counters.misses++;
+    FRESULT result = IndexedStat(path, info);
+    if (result == FR_OK || result == FR_NO_FILE || result == FR_NO_PATH)
+    {
+        memcpy(victim->path, path, len + 1);
+        victim->info = *info;
+        victim->result = result;
+        victim->last_used = ++stat_cache_clock;
+        victim->valid = true;
+    }
+    return result;
+}
+
+void SDCard::InvalidateStatCache() const
+{
+    for (StatCacheEntry& entry : stat_cache)
+        entry.valid = false;
+}
+
+const char* SDCard::FromRoot(const char* path) const
+{
+    // FatFs takes a path without a drive to be on drive 0
+    const char* colon = strchr(path, ':');
+    if (colon)
+    {
+        const char* own_colon = strchr(pc_name, ':');
+        const char* own = own_colon ? pc_name : "0";
+        size_t own_length = own_colon ? own_colon - pc_name : 1;
+        if ((size_t)(colon - path) != own_length || strncmp(path, own, own_length) != 0)
+            return nullptr;
+        path = colon + 1;
+    }
+
+    if (*path != '/' && *path != '\\' && !at_root)
+        return nullptr;
+    path += strspn(path, "/\\");
+
+    // FatFs walks "." and ".." itself, and folds case beyond ASCII by its code page
+    for (const char* part = path; *part; part += strspn(part, "/\\"))
+    {
+        size_t length = strcspn(part, "/\\");
+        if (length <= 2 && strncmp(part, "..", length) == 0)
+            return nullptr;
+        for (; length; length--, part++)
+        {
+            if ((uint8_t)*part >= 0x80)
+                return nullptr;
+        }
+    }
+    return path;
+}
+
+SDCardNameIndex* SDCard::FindNameIndex(const char* path, const char*& name) const
+{
+    name = nullptr;
+    const char* rest = FromRoot(path);
+    if (!rest)
+        return nullptr;
+
+    // the directory part ends at the last separator, "dir/" names nothing in dir
+    const char* split = nullptr;
+    for (const char* c = rest; *c; c++)
+    {
+        if (*c == '/' || *c == '\\')
+            split = c;
+    }
+    size_t dir_length = split ? split - rest : 0;
+    while (dir_length && (rest[dir_length - 1] == '/' || rest[dir_length - 1] == '\\'))
+        dir_length--;
+    name = split ? split + 1 : rest;
+    if (*name == '\0')
+    {
+        name = nullptr;
+        return nullptr;
+    }
+
+    for (SDCardNameIndex& index : name_indexes)
+    {
+        const char* own = index.IsEnabled() ? FromRoot(index.GetPath()) : nullptr;
+        if (own && SDCardNameIndex::SkipParts(rest, dir_length, own, strlen(own)) == rest + dir_length)
+            return &index;
+    }
+    return nullptr;
+}
+
+void SDCard::InvalidateNameIndexesBelow(const char* path) const
+{
+    const char* rest = FromRoot(path);
+    size_t length = rest ? strlen(rest) : 0;
+    for (SDCardNameIndex& index : name_indexes)
+    {
+        const char* own = index.IsEnabled() && rest ? FromRoot(index.GetPath()) : nullptr;
+        if (!own || SDCardNameIndex::SkipParts(own, strlen(own), rest, length))
+            index.Invalidate();
+    }
+}
+
+FRESULT SDCard::IndexedStat(const char* path, FILINFO* info) const
+{
+    const char* name;
+    SDCardNameIndex* index = FindNameIndex(path, name);
+    if (index && SDCardNameIndex::IsIndexable(name))
+    {
+        switch (index->Lookup(name, *info))
+        {
+        case SDCardNameIndex::Result::FOUND:
+            return FR_OK;
+        case SDCardNameIndex::Result::ABSENT:
+            return FR_NO_FILE;
+        default:
+            break;
+        }
+    }
+    return f_stat(path, info);
+}
+
+bool SDCard::MayExist(const char* path) const
+{
+    const char* name;
+    SDCardNameIndex* index = FindNameIndex(path, name);
+    return !index || !SDCardNameIndex::IsIndexable(name) || index->MayContain(name);
+}
+
+void SDCard::NoteAdded(const char* path) const
+{
+    const char* name;
+    SDCardNameIndex* index = FindNameIndex(path, name);
+    if (!name)
+    {
+        // it may have gone into any indexed directory, none of them can say it is absent now
+        InvalidateNameIndexes();
+        return;
+    }
+
+    // a directory moved in brings the entries below it along
+    InvalidateNameIndexesBelow(path);
+    if (!index)
+        return;
+
+    // FatFs may have stored such a name differently, "name." as "name" for one
+    if (SDCardNameIndex::IsIndexable(name))
+        index->Added(name);
+    else
+        index->Invalidate();
+}
+
+void SDCard::NoteRemoved(const char* path) const
+{
+    const char* name;
+    SDCardNameIndex* index = FindNameIndex(path, name);
+    if (!name)
+    {
+        InvalidateNameIndexes();
+        return;
+    }
+
+    // a directory takes the indexes of the directories below it along
+    InvalidateNameIndexesBelow(path);
+    if (!index)
+        return;
+
+    if (SDCardNameIndex::IsIndexable(name))
+        index->Removed(name);
+    else
+        index->Invalidate();
+}
+
+bool SDCard::OpenIndexed(FIL* file, const char* path, BYTE mode)
+{
+    // opening a file that is not there fails without FatFs searching the directory for it
+    bool creates = mode & (FA_CREATE_NEW | FA_CREATE_ALWAYS | FA_OPEN_ALWAYS);
+    if (!creates && !MayExist(path))
+        return false;
+
+    if (f_open(file, path, mode) != FR_OK)
+        return false;
+    if (creates)
+        NoteAdded(path);
+    return true;
+}
+
+void SDCard::InvalidateNameIndexes() const
+{
+    for (SDCardNameIndex& index : name_indexes)
+        index.Invalidate();
+}
+
+bool SDCard::IndexDirectory(const char* dir_path)
+{
+    if (name_index_count == 0 || !FromRoot(dir_path))
+        return false;
+    if (GetDirectoryIndex(dir_path))
+        return true;
+
+    for (SDCardNameIndex& index : name_indexes)
+    {
+        if (!index.IsEnabled())
+            return index.Enable(dir_path);
+    }
+    return false;
+}
+
+void SDCard::RefreshDirectoryIndex(const char* dir_path)
+{
+    for (SDCardNameIndex& index : name_indexes)
+    {
+        if (&index == GetDirectoryIndex(dir_path))
+            index.Invalidate();
+    }
+}
+
+void SDCard::DropDirectoryIndex(const char* dir_path)
+{
+    for (SDCardNameIndex& index : name_indexes)
+    {
+        if (!dir_path || &index == GetDirectoryIndex(dir_path))
+            index.Disable();
+    }
+}
+
+const SDCardNameIndex* SDCard::GetDirectoryIndex(const char* dir_path) const
+{
+    const char* dir = FromRoot(dir_path);
+    if (!dir)
+        return nullptr;
+    size_t length = strlen(dir);
+    while (length && (dir[length - 1] == '/' || dir[length - 1] == '\\'))
+        length--;
+
+    for (const SDCardNameIndex& index : name_indexes)
+    {
+        const char* own = index.IsEnabled() ? FromRoot(index.GetPath()) : nullptr;
+        if (own && SDCardNameIndex::SkipParts(dir, length, own, strlen(own)) == dir + length)
+            return &index;
+    }
+    return nullptr;
+}
+
+bool SDCard::BeginStream(uint64_t expected_bytes)
+{
+    if (!is_file_open || active->streaming)
+        return false;
+
+    FlushWriteBuffer();
+#if FF_USE_EXPAND
+    // A fresh file gets its whole run of clusters now, so FatFs never has to stop the
+    // transfer to read or write the FAT while extending the chain.
+    if (expected_bytes && f_size(&active->file) == 0 && f_expand(&active->file, expected_bytes, 1) == FR_OK)
+        active->stream_preallocated = true;
+#endif
+
+    active->streaming = true;
+    return true;
+}
+
+bool SDCard::EndStream()
+{
+    if (!is_file_open || !active->streaming)
+        return false;
+
+    active->streaming = false;
+    bool result = FlushWriteBuffer();
+    if (active->stream_preallocated)
+    {
+        // give back what the estimate allocated past the data
+        if (f_tell(&active->file) < f_size(&active->file))
+            result = f_truncate(&active->file) == FR_OK && result;
+        active->stream_preallocated = false;
+    }
+
+    // CTRL_SYNC is what ends an open multi-block write at the driver
+    return f_sync(&active->file) == FR_OK && result;
+}
+
 SDCard::SDCard(const char* pc_name)
-    : StorageDevice(), pc_name(pc_name), current_file_path(nullptr)
+    : StorageDevice(), active(&file_slots[default_handle]), pc_name(pc_name)
 {
     _insts.push_back(this);
 }
@@ -57,6 +729,7 @@ SDCard::~SDCard()
 
 UniqueArray<DirectoryEntry> SDCard::PeekDirectory(const char* dir_path) const
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_DIRECTORY);
     
     size_t count = 0;
     if (f_opendir(&directory, dir_path) != FR_OK)
@@ -88,68 +761,80 @@ UniqueArray<DirectoryEntry> SDCard::PeekDirectory(const char* dir_path) const
 
 size_t SDCard::GetTotalCountInDirectory(const char* dir_path) const
 {
-    
+    DirectorySummary summary = GetDirectorySummary(dir_path);
+    return summary.file_count + summary.directory_count;
+}
+
+size_t SDCard::GetFileCountInDirectory(const char* dir_path) const
+{
+    return GetDirectorySummary(dir_path).file_count;
+}
+
+size_t SDCard::GetDirectoryCountInDirectory(const char* dir_path) const
+{
+    return GetDirectorySummary(dir_path).directory_count;
+}
+
+size_t SDCard::ForEachInDirectory(const char* dir_path, DirectoryVisitor visitor, void* user_data, const DirectoryFilter& filter) const
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_DIRECTORY);
+    DirectoryIterator it(dir_path, filter);
+    DirectoryEntry entry;
     size_t count = 0;
-    if (f_opendir(&directory, dir_path) != FR_OK)
-        return 0;
-    
-    FILINFO f;
-    while (f_readdir(&directory, &f) == FR_OK)
+    while (it.Next(entry))
     {
-        if (f.fname[0] == 0)
-            break;
         count++;
+        if (!visitor(entry, it.GetInfo(), user_data))
+            break;
     }
-
-    f_closedir(&directory);
     return count;
 }
 
-size_t SDCard::GetFileCountInDirectory(const char* dir_path) const
+size_t SDCard::ListDirectory(const char* dir_path, SDCardDirectoryListing& listing, size_t offset, size_t count, const DirectoryFilter& filter) const
 {
-    
-    size_t count = 0;
-    if (f_opendir(&directory, dir_path) != FR_OK)
-        return 0;
-    
-    FILINFO f;
-    while (f_readdir(&directory, &f) == FR_OK)
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_DIRECTORY);
+    listing.Clear(offset);
+    DirectoryIterator it(dir_path, filter);
+    for (size_t skipped = 0; skipped < offset; skipped++)
+    {
+        if (!it.Next())
+            return 0;
+    }
+
+    while (it.Next())
     {
-        if (f.fname[0] == 0)
+        if ((count && listing.count == count) || !listing.Add(it.GetInfo()))
+        {
+            listing.more = true;
             break;
-        
-        if (f.fattrib & AM_DIR)
-            continue;
-        
-        count++;
+        }
     }
-    f_closedir(&directory);
-    return count;
+    return listing.count;
 }
 
-size_t SDCard::GetDirectoryCountInDirectory(const char* dir_path) const
+SDCard::DirectorySummary SDCard::GetDirectorySummary(const char* dir_path, const DirectoryFilter& filter) const
 {
-    size_t count = 0;
-    if (f_opendir(&directory, dir_path) != FR_OK)
-        return 0;
-    
-    FILINFO f;
-    while (f_readdir(&directory, &f) == FR_OK)
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_DIRECTORY);
+    DirectorySummary summary = {};
+    DirectoryIterator it(dir_path, filter);
+    while (it.Next())
     {
-        if (f.fname[0] == 0)
-            break;
-        
-        if (f.fattrib & AM_DIR)
-            count++;
+        const FILINFO& info = it.GetInfo();
+        if (info.fattrib & AM_DIR)
+            summary.directory_count++;
+        else
+        {
+            summary.file_count++;
+            summary.total_bytes += info.fsize;
+        }
     }
-    f_closedir(&directory);
-    return count;
+    return summary;
 }
 
 DirectoryEntry SDCard::GetDirectoryEntry(const char* path) const
 {
     FILINFO f;
-    if (f_stat(path, &f) == FR_OK)
+    if (CachedStat(path, &f) == FR_OK)
     {
         return GetEntryFromFatFsStat(f);
     }
@@ -158,39 +843,276 @@ DirectoryEntry SDCard::GetDirectoryEntry(const char* path) const
 
 bool SDCard::ChangeDirectory(const char* path)
 {
-    return f_chdir(path) == FR_OK;
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_CHANGE_DIRECTORY);
+    InvalidateStatCache(); // cached relative paths mean something else now
+    InvalidateNameIndexes();
+    if (f_chdir(path) != FR_OK)
+        return false;
+
+    // read against the directory it was relative to
+    const char* rest = FromRoot(path);
+    at_root = rest && rest[strspn(rest, "/\\")] == '\0';
+    return true;
 }
 
 bool SDCard::CreateDirectory(const char* dir_path)
 {
-    return f_mkdir(dir_path) == FR_OK;
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_CREATE_DIRECTORY);
+    InvalidateStatCache();
+    if (f_mkdir(dir_path) != FR_OK)
+        return false;
+    NoteAdded(dir_path);
+    return true;
 }
 
 bool SDCard::Move(const char* path, const char* new_path)
 {
-    return f_rename(path, new_path) == FR_OK;
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_RENAME);
+    InvalidateStatCache(); // a moved directory takes every cached path below it along
+    if (f_rename(path, new_path) != FR_OK)
+        return false;
+    NoteRemoved(path);
+    NoteAdded(new_path);
+    return true;
 }
 
 bool SDCard::Rename(const char* name, const char* new_name)
 {
-    return f_rename(name, new_name) == FR_OK;
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_RENAME);
+    InvalidateStatCache();
+    if (f_rename(name, new_name) != FR_OK)
+        return false;
+    NoteRemoved(name);
+    NoteAdded(new_name);
+    return true;
 }
 
 bool SDCard::Mount()
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_MOUNT);
     if (is_mounted)
         return false;
 
-    is_mounted = true;
-    return f_mount(&fs, pc_name, 1) == FR_OK;
+    InvalidateStatCache();
+    InvalidateNameIndexes();
+    mount_timing = {};
+    // Until RestoreVolumeMemo has read this volume's serial, Unmount has no identity to save
+    // the counts under; the one kept from the last card only stays for comparing against.
+    volume_memo.identified = false;
+    at_root = true; // FatFs starts a volume there
+    // the driver fills in the block functions here, so the link monitor and the sector cache can go in front of them
+    sd_init_driver();
+    AttachLinkMonitor();
+    SDCardSectorCache::Attach(this);
+
+    // it may be a different card, so what was learnt about the last one does not count
+    clock_policy.Reset(clock_policy.GetConfig());
+    ApplyBusClock();
+
+    if (lazy_mount)
+    {
+        mount_timing.lazy = true; // FatFs initialises the card
+        is_mounted = f_mount(&fs, pc_name, 0) == FR_OK;
+        return is_mounted;
+    }
+
+    // Initialise the card first so its share of the time can be told apart. FatFs asks the
+    // driver again inside f_mount, which returns straight away for an initialised card.
+    uint32_t start = NowUs();
+    bool ready = !card.init || !(card.init(&card) & STA_NOINIT);
+    uint32_t initialised = NowUs();
+    is_mounted = ready && f_mount(&fs, pc_name, 1) == FR_OK;
+    mount_timing.card_init_us = initialised - start;
+    mount_timing.volume_parse_us = NowUs() - initialised;
+
+    if (!is_mounted)
+    {
+        f_unmount(pc_name);
+        SDCardSectorCache::Detach(this);
+        DetachLinkMonitor();
+        return false;
+    }
+
+    RestoreVolumeMemo();
+    return true;
+}
+
+SDCard* SDCard::GetByCard(sd_card_t* sd_card_p)
+{
+    for (SDCard* inst : _insts)
+    {
+        if (&inst->card == sd_card_p)
+            return inst;
+    }
+    return nullptr;
+}
+
+SDCardClockPolicy::Outcome SDCard::ClassifyResult(block_dev_err_t result)
+{
+    switch (result)
+    {
+    case SD_BLOCK_DEVICE_ERROR_NONE:
+        return SDCardClockPolicy::Outcome::OK;
+    case SD_BLOCK_DEVICE_ERROR_CRC:
+        return SDCardClockPolicy::Outcome::CRC_ERROR;
+    case SD_BLOCK_DEVICE_ERROR_NO_RESPONSE:
+        return SDCardClockPolicy::Outcome::TIMEOUT;
+    default:
+        return SDCardClockPolicy::Outcome::OTHER_ERROR; // bad parameters, write protection, no card, ...
+    }
+}
+
+block_dev_err_t SDCard::LinkReadBlocks(sd_card_t* sd_card_p, uint8_t* buffer, uint64_t sector, uint32_t count)
+{
+    SDCard* owner = GetByCard(sd_card_p);
+    if (!owner)
+        return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
+    SDCardMetrics::Scope scope(owner->metrics, SDCardMetrics::OP_BLOCK_READ);
+    scope.AddBytes((uint64_t)count * FF_MIN_SS);
+    return owner->OnLink([&]() {
+        owner->metrics.CountRead(count);
+        return owner->driver_block_layer.read_blocks(sd_card_p, buffer, sector, count);
+    });
+}
+
+block_dev_err_t SDCard::LinkWriteBlocks(sd_card_t* sd_card_p, const uint8_t* buffer, uint64_t sector, uint32_t count)
+{
+    SDCard* owner = GetByCard(sd_card_p);
+    if (!owner)
+        return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
+    SDCardMetrics::Scope scope(owner->metrics, SDCardMetrics::OP_BLOCK_WRITE);
+    scope.AddBytes((uint64_t)count * FF_MIN_SS);
+    return owner->OnLink([&]() {
+        owner->metrics.CountWrite(count);
+        return owner->driver_block_layer.write_blocks(sd_card_p, buffer, sector, count);
+    });
+}
+
+block_dev_err_t SDCard::LinkSync(sd_card_t* sd_card_p)
+{
+    SDCard* owner = GetByCard(sd_card_p);
+    if (!owner)
+        return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
+    SDCardMetrics::Scope scope(owner->metrics, SDCardMetrics::OP_BLOCK_SYNC);
+    return owner->OnLink([&]() {
+        owner->metrics.CountSync();
+        return owner->driver_block_layer.sync(sd_card_p);
+    });
+}
+
+void SDCard::AttachLinkMonitor()
+{
+    if (!card.read_blocks || !card.write_blocks || !card.sync || card.read_blocks == &LinkReadBlocks)
+        return;
+
+    driver_block_layer.read_blocks = card.read_blocks;
+    driver_block_layer.write_blocks = card.write_blocks;
+    driver_block_layer.sync = card.sync;
+    card.read_blocks = &LinkReadBlocks;
+    card.write_blocks = &LinkWriteBlocks;
+    card.sync = &LinkSync;
+}
+
+void SDCard::DetachLinkMonitor()
+{
+    if (card.read_blocks != &LinkReadBlocks)
+        return;
+
+    card.read_blocks = driver_block_layer.read_blocks;
+    card.write_blocks = driver_block_layer.write_blocks;
+    card.sync = driver_block_layer.sync;
+}
+
+void SDCard::ApplyBusClock()
+{
+    if (clock_policy.GetRate())
+        SetBusClock(clock_policy.GetRate());
+}
+
+bool SDCard::SetBusClock(uint32_t hz)
+{
+    return false;
+}
+
+void SDCard::SetClockConfig(const SDCardClockPolicy::Config& config)
+{
+    clock_policy.Reset(config);
+    if (is_mounted)
+        ApplyBusClock();
+}
+
+bool SDCard::ReadVolumeSerial(uint32_t& serial)
+{
+    // The boot sector. FatFs has just read it, so with the sector cache this costs no card access.
+    if (!ReadSectors(block_buffer, fs.volbase, 1))
+        return false;
+
+    size_t offset = 39; // BS_VolID
+    if (fs.fs_type == FS_FAT32)
+        offset = 67; // BS_VolID32
+#if FF_FS_EXFAT
+    else if (fs.fs_type == FS_EXFAT)
+        offset = 100; // BPB_VolIDEx
+#endif
+    memcpy(&serial, block_buffer + offset, sizeof(serial));
+    return true;
+}
+
+void SDCard::SaveVolumeMemo()
+{
+    volume_memo.valid = volume_memo.identified && fs.fs_type != 0 && fs.free_clst <= fs.n_fatent - 2;
+    if (!volume_memo.valid)
+        return;
+
+    volume_memo.free_clst = fs.free_clst;
+    volume_memo.last_clst = fs.last_clst;
+}
+
+bool SDCard::RestoreVolumeMemo()
+{
+    uint32_t serial;
+    bool identified = fs.fs_type != 0 && ReadVolumeSerial(serial);
+    bool restored = identified && volume_memo.valid && fs.free_clst > fs.n_fatent - 2
+        && serial == volume_memo.serial && fs.volbase == volume_memo.volbase
+        && fs.n_fatent == volume_memo.n_fatent && fs.fsize == volume_memo.fsize;
+    if (restored)
+    {
+        // Same volume as last time. If it was written elsewhere in between, RecomputeFreeSpace corrects it.
+        fs.free_clst = volume_memo.free_clst;
+        fs.last_clst = volume_memo.last_clst;
+        mount_timing.fast_remount = true;
+    }
+
+    // the counts saved at Unmount belong with this identity
+    volume_memo.valid = false;
+    volume_memo.identified = identified;
+    if (identified)
+    {
+        volume_memo.serial = serial;
+        volume_memo.volbase = fs.volbase;
+        volume_memo.n_fatent = fs.n_fatent;
+        volume_memo.fsize = fs.fsize;
+    }
+    return restored;
 }
 
 bool SDCard::Unmount()
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_UNMOUNT);
     if (is_mounted)
     {
+        // FatFs invalidates every file object of the volume on unmount, so close them properly first
+        for (FileHandle handle = 0; handle < (FileHandle)max_open_files; handle++)
+            CloseHandle(handle);
+
+        InvalidateStatCache();
+        InvalidateNameIndexes();
+        SaveVolumeMemo();
         is_mounted = false;
-        return f_unmount(pc_name) == FR_OK;
+        bool result = f_unmount(pc_name) == FR_OK;
+        SDCardSectorCache::Detach(this);
+        DetachLinkMonitor();
+        return result;
     }
 
     return false; 
@@ -198,58 +1120,155 @@ bool SDCard::Unmount()
 
 bool SDCard::OpenFile(const char* file_path, uint32_t access_mask)
 {
-    if (is_file_open)
-        f_close(&file);
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_OPEN);
+    if (active->is_open)
+    {
+        EndStream();
+        FlushWriteBuffer();
+        if (active->file.flag & FA_WRITE)
+            InvalidateStatCache();
+        f_close(&active->file);
+    }
     
-    is_file_open = true;
-    current_file_path = file_path;
-    return f_open(&file, file_path, TranslateFileAccessFlags(access_mask)) == FR_OK;
+    BYTE mode = TranslateFileAccessFlags(access_mask);
+    if (MayChangeFile(mode))
+        InvalidateStatCache();
+    active->path = file_path;
+    active->is_open = OpenIndexed(&active->file, file_path, mode);
+    is_file_open = active->is_open;
+    return is_file_open;
 }
 
 bool SDCard::CloseFile()
 {
-    if (is_file_open)
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_CLOSE);
+    if (active->is_open)
     {
+        EndStream();
+        bool flushed = FlushWriteBuffer();
+        active->is_open = false;
         is_file_open = false;
-        return f_close(&file) == FR_OK;
+        bool written = active->file.flag & FA_WRITE;
+        bool closed = f_close(&active->file) == FR_OK;
+        if (written)
+            InvalidateStatCache();
+        return closed && flushed;
     }
     return false;
 }
 
+SDCard::FileHandle SDCard::OpenHandle(const char* file_path, uint32_t access_mask)
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_OPEN);
+    // the default slot is left for OpenFile
+    for (FileHandle handle = default_handle + 1; handle < (FileHandle)max_open_files; handle++)
+    {
+        FileSlot& slot = file_slots[handle];
+        if (slot.is_open)
+            continue;
+
+        BYTE mode = TranslateFileAccessFlags(access_mask);
+        if (MayChangeFile(mode))
+            InvalidateStatCache();
+        if (!OpenIndexed(&slot.file, file_path, mode))
+            return invalid_handle;
+        slot.path = file_path;
+        slot.is_open = true;
+        slot.write_buffered = 0;
+        return handle;
+    }
+    return invalid_handle;
+}
+
+bool SDCard::CloseHandle(FileHandle handle)
+{
+    if (handle < 0 || handle >= (FileHandle)max_open_files)
+        return false;
+
+    FileSlot* prev = active;
+    active = &file_slots[handle];
+    bool result = CloseFile();
+    active = prev;
+    is_file_open = active->is_open;
+    return result;
+}
+
+bool SDCard::SelectHandle(FileHandle handle)
+{
+    if (handle < 0 || handle >= (FileHandle)max_open_files)
+        return false;
+
+    active = &file_slots[handle];
+    is_file_open = active->is_open;
+    return true;
+}
+
+size_t SDCard::ReadBuffer(FileHandle handle, void* buffer, size_t max_bytes)
+{
+    return WithHandle(handle, (size_t)0, [&]() { return ReadBuffer(buffer, max_bytes); });
+}
+
+size_t SDCard::WriteBuffer(FileHandle handle, const void* buffer, size_t max_bytes)
+{
+    return WithHandle(handle, (size_t)0, [&]() { return WriteBuffer(buffer, max_bytes); });
+}
+
+bool SDCard::Seek(FileHandle handle, uint64_t index)
+{
+    return WithHandle(handle, false, [&]() { return Seek(index); });
+}
+
+bool SDCard::Flush(FileHandle handle)
+{
+    return WithHandle(handle, false, [&]() { return Flush(); });
+}
+
 bool SDCard::Seek(uint64_t index)
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_SEEK);
     if (is_file_open)
     {
-        uint64_t size = f_size(&file);
+        EndStream();
+        FlushWriteBuffer();
+        uint64_t size = f_size(&active->file);
         index = index > size ? size : index; // clamp to end if index too high
-        return f_lseek(&file, index) == FR_OK;
+        return Lseek(&active->file, index) == FR_OK;
     }
     return false;
 }
 
 bool SDCard::SeekStart()
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_SEEK);
     if (is_file_open)
     {
-        return f_lseek(&file, 0) == FR_OK;
+        EndStream();
+        FlushWriteBuffer();
+        return Lseek(&active->file, 0) == FR_OK;
     }
     return false;
 }
 
 bool SDCard::SeekEnd()
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_SEEK);
     if (is_file_open)
     {
-        return f_lseek(&file, f_size(&file)) == FR_OK;
+        EndStream();
+        FlushWriteBuffer();
+        return Lseek(&active->file, f_size(&active->file)) == FR_OK;
     }
     return false;
 }
 
 bool SDCard::SeekStep(int64_t d_idx)
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_SEEK);
     if (is_file_open)
     {
-        return f_lseek(&file, f_tell(&file) + d_idx) == FR_OK;
+        EndStream();
+        FlushWriteBuffer();
+        return Lseek(&active->file, f_tell(&active->file) + d_idx) == FR_OK;
     }
     return false;
 }
@@ -262,93 +1281,330 @@ uint64_t SDCard::GetFileSize(const char* path) const
 uint64_t SDCard::GetFileSize() const
 {
     if (is_file_open)
-        return f_size(&file);
+    {
+        uint64_t buffered_end = f_tell(&active->file) + active->write_buffered; // buffered bytes may extend the file
+        if (active->stream_preallocated)
+            return buffered_end; // f_size is the estimate until EndStream trims it
+        return buffered_end > f_size(&active->file) ? buffered_end : f_size(&active->file);
+    }
 
-    return GetFileSize(current_file_path);
+    return GetFileSize(active->path);
 }
 
 uint64_t SDCard::GetFreeSpace() const
 {
-    DWORD free_clusters;
-    auto addr = &fs;
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_FREE_SPACE);
+    if (!is_mounted)
+        return 0;
 
-    if (f_getfree(pc_name, &free_clusters, &addr) == FR_OK)
+    // After a lazy mount this may be the first access. Opening the root has FatFs mount the
+    // volume, reading FSINFO, without counting anything.
+    if (fs.fs_type == 0)
     {
-        return free_clusters * fs.csize * FF_MIN_SS; // FF_MIN_SS should be 512
+        DIR root;
+        if (f_opendir(&root, pc_name) == FR_OK)
+            f_closedir(&root);
     }
-    return 0;
+
+    // Once known, FatFs keeps fs.free_clst current itself: every cluster the write, truncate and
+    // delete paths allocate or release adjusts it. Only the first query after mounting has to count,
+    // and not even that when the card is the one mounted last time.
+    if (fs.fs_type == 0 || fs.free_clst > fs.n_fatent - 2)
+    {
+        if (!const_cast<SDCard*>(this)->RestoreVolumeMemo())
+        {
+            uint32_t start = NowUs();
+            DWORD free_clusters;
+            FATFS* addr = &fs;
+            if (f_getfree(pc_name, &free_clusters, &addr) != FR_OK)
+                return 0;
+            mount_timing.free_count_us = NowUs() - start;
+        }
+    }
+    return (uint64_t)fs.free_clst * fs.csize * GetSectorSize();
 }
 
 uint64_t SDCard::GetTotalSpace() const
 {
-    return (fs.n_fatent - 2) * fs.csize;
+    if (!is_mounted || fs.fs_type == 0)
+        return 0;
+    return (uint64_t)(fs.n_fatent - 2) * fs.csize * GetSectorSize();
 }
 
 float SDCard::GetSpaceUsedPercentage() const
 {
-    return (GetFreeSpace() / (float)GetTotalSpace()) * 100.f;
+    uint64_t total = GetTotalSpace();
+    if (total == 0)
+        return 0.f;
+    return ((total - GetFreeSpace()) / (float)total) * 100.f;
+}
+
+bool SDCard::RecomputeFreeSpace()
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_FREE_SPACE);
+    if (!is_mounted)
+        return false;
+
+    // forget the count so f_getfree walks the FAT (or the exFAT bitmap) again
+    fs.free_clst = 0xFFFFFFFF;
+    DWORD free_clusters;
+    FATFS* addr = &fs;
+    return f_getfree(pc_name, &free_clusters, &addr) == FR_OK;
+}
+
+bool SDCard::PreallocateFile(const char* path, uint64_t bytes)
+{
+#if FF_USE_EXPAND
+    FileHandle handle = OpenHandle(path, WRITE | CREATE_OVERWRITE);
+    if (handle == invalid_handle)
+        return false;
+
+    bool result = f_expand(&file_slots[handle].file, bytes, 1) == FR_OK;
+    return CloseHandle(handle) && result;
+#else
+    return false; // needs FF_USE_EXPAND in ffconf.h
+#endif
+}
+
+FRESULT SDCard::Lseek(FIL* fp, FSIZE_t offset)
+{
+    metrics.CountSeek();
+    return f_lseek(fp, offset);
+}
+
+bool SDCard::ReadSectors(void* buffer, LBA_t sector, uint32_t count)
+{
+    return card.read_blocks && card.read_blocks(&card, (uint8_t*)buffer, sector, count) == SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+bool SDCard::WriteSectors(const void* buffer, LBA_t sector, uint32_t count)
+{
+    return card.write_blocks && card.write_blocks(&card, (const uint8_t*)buffer, sector, count) == SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+uint32_t SDCard::GetSectorSize() const
+{
+#if FF_MAX_SS != FF_MIN_SS
+    return fs.ssize;
+#else
+    return FF_MIN_SS;
+#endif
 }
 
 FILINFO SDCard::GetFileStats(const char* path) const
 {
-    FILINFO inf;
-    f_stat(path, &inf);
+    FILINFO inf = {};
+    CachedStat(path, &inf);
     return inf;
 }
 
 FILINFO SDCard::GetFileStats() const
 {
-    return GetFileStats(current_file_path);
+    return GetFileStats(active->path);
+}
+
+size_t SDCard::ReadBuffer(void* buffer, size_t max_bytes)
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_READ);
+    if (is_file_open)
+    {
+        EndStream();
+        FlushWriteBuffer();
+        UINT bytes_read;
+        f_read(&active->file, buffer, max_bytes, &bytes_read);
+        scope.AddBytes(bytes_read);
+        return bytes_read;
+    }
+    return 0;
+}
+
+char SDCard::ReadCharacter()
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_READ);
+    if (is_file_open)
+    {
+        EndStream();
+        FlushWriteBuffer();
+        char c;
+        UINT bytes_read;
+        f_read(&active->file, &c, 1, &bytes_read);
+        scope.AddBytes(bytes_read);
+        return c;
+    }
+    return '\0';
+}
+
+size_t SDCard::ReadAll(UniqueArray<char>& buffer)
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_READ);
+    if (is_file_open)
+    {
+        EndStream();
+        FlushWriteBuffer();
+        UINT bytes_read;
+        uint64_t size = f_size(&active->file) - f_tell(&active->file);
+        buffer.array = std::make_unique<char[]>(size);
+        if (f_read(&active->file, buffer.array.get(), size, &bytes_read) != FR_OK)
+            bytes_read = 0;
+        buffer.length = bytes_read;
+        scope.AddBytes(bytes_read);
+        return bytes_read;
+    }
+    return 0;
 }
 
-size_t SDCard::ReadBuffer(void* buffer, size_t max_bytes)
+size_t SDCard::ReadAll(void* arena, size_t capacity)
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_READ);
     if (is_file_open)
     {
+        EndStream();
+        FlushWriteBuffer();
+        uint64_t size = f_size(&active->file) - f_tell(&active->file);
+        if (size > capacity)
+            return 0;
+
         UINT bytes_read;
-        f_read(&file, buffer, max_bytes, &bytes_read);
+        if (f_read(&active->file, arena, size, &bytes_read) != FR_OK)
+            return 0;
+        scope.AddBytes(bytes_read);
         return bytes_read;
     }
     return 0;
 }
 
-char SDCard::ReadCharacter()
+uint64_t SDCard::StreamFile(ChunkVisitor visitor, void* user_data, void* buffer, size_t buffer_size)
 {
-    if (is_file_open)
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_READ);
+    if (!is_file_open)
+        return 0;
+
+    if (!buffer)
     {
-        char c;
-        UINT bytes_read;
-        f_read(&file, &c, 1, &bytes_read);
-        return c;
+        buffer = block_buffer;
+        buffer_size = block_buffer_size;
     }
-    return '\0';
-}
+    buffer_size -= buffer_size % FF_MIN_SS;
+    if (buffer_size == 0)
+        return 0;
 
-size_t SDCard::ReadAll(UniqueArray<char>& buffer)
-{
-    if (is_file_open)
+    EndStream();
+    FlushWriteBuffer();
+    uint64_t streamed = 0;
+    while (1)
     {
+        // the first slice ends on a sector boundary, so every later one starts on one
+        // and FatFs reads its whole sectors straight into the buffer
+        uint64_t offset = f_tell(&active->file);
+        size_t to_read = buffer_size - offset % FF_MIN_SS;
+
         UINT bytes_read;
-        uint64_t size = f_size(&file);
-        buffer.array = std::make_unique<char[]>(size);
-        f_read(&file, buffer.array.get(), size, &bytes_read);
-        return bytes_read;
+        if (f_read(&active->file, buffer, to_read, &bytes_read) != FR_OK || bytes_read == 0)
+            break;
+        streamed += bytes_read;
+        if (!visitor((const uint8_t*)buffer, bytes_read, offset, user_data) || bytes_read < to_read)
+            break;
     }
-    return 0;
+    scope.AddBytes(streamed);
+    return streamed;
 }
 
 size_t SDCard::ReadLine(UniqueArray<char>& buffer, bool from_start_of_line)
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_READ_LINE);
     if (is_file_open)
     {
+        EndStream();
+        FlushWriteBuffer();
         if (from_start_of_line)
         {
             int64_t prev_line_end = FindPreviousCharacter('\n');
-            f_lseek(&file, prev_line_end + 1);
+            Lseek(&active->file, prev_line_end + 1);
+        }
+
+        uint64_t start = f_tell(&active->file);
+        size_t capacity = buffer.array ? buffer.length : 0;
+        size_t length = 0;
+        while (1)
+        {
+            if (length + 1 >= capacity) // grow, keeping room for the terminator
+            {
+                size_t new_capacity = capacity < 64 ? 128 : capacity * 2;
+                std::unique_ptr<char[]> grown = std::make_unique<char[]>(new_capacity);
+                if (length)
+                    memcpy(grown.get(), buffer.array.get(), length);
+                buffer.array = std::move(grown);
+                capacity = new_capacity;
+            }
+
+            // never read past the sector FatFs is holding, so stepping back after the newline is free
+            size_t to_read = FF_MIN_SS - (start + length) % FF_MIN_SS;
+            to_read = to_read < capacity - 1 - length ? to_read : capacity - 1 - length;
+
+            UINT bytes_read;
+            if (f_read(&active->file, buffer.array.get() + length, to_read, &bytes_read) != FR_OK || bytes_read == 0)
+                break;
+
+            char* newline = (char*)memchr(buffer.array.get() + length, '\n', bytes_read);
+            if (newline)
+            {
+                size_t line_length = newline - buffer.array.get() + 1; // keeps the newline, like f_gets
+                if (line_length < length + bytes_read)
+                    Lseek(&active->file, start + line_length);
+                length = line_length;
+                break;
+            }
+            length += bytes_read;
+        }
+        buffer.array[length] = '\0';
+        buffer.length = capacity;
+        scope.AddBytes(length);
+        return length;
+    }
+    return 0;
+}
+
+size_t SDCard::ReadLastLines(UniqueArray<char>& buffer, size_t line_count)
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_READ_LINE);
+    if (is_file_open && line_count > 0)
+    {
+        EndStream();
+        FlushWriteBuffer();
+        uint64_t loc = f_tell(&active->file);
+        uint64_t size = f_size(&active->file);
+        if (size == 0)
+            return 0;
+
+        // a newline at the very end closes the last line rather than starting an empty one
+        char last;
+        UINT bytes_read;
+        bool result = Lseek(&active->file, size - 1) == FR_OK && f_read(&active->file, &last, 1, &bytes_read) == FR_OK
+            && bytes_read == 1;
+        if (result)
+        {
+            uint64_t before = last == '\n' ? size - 1 : size;
+
+            // the line_count-th newline back ends the line just before the ones we want
+            int64_t line_end = ScanBackward("\n", 1, before, line_count);
+            uint64_t start = line_end < 0 ? 0 : line_end + 1;
+
+            size_t length = size - start;
+            buffer.array = std::make_unique<char[]>(length + 1);
+            result = Lseek(&active->file, start) == FR_OK
+                && f_read(&active->file, buffer.array.get(), length, &bytes_read) == FR_OK;
+        }
+        if (!result)
+        {
+            // an empty string rather than whatever part of the lines made it
+            buffer.array = std::make_unique<char[]>(1);
+            bytes_read = 0;
         }
-        char* buff = f_gets(buffer.array.get(), 4096, &file);
-        size_t bytes_read = strlen(buff);
+        buffer.array[bytes_read] = '\0';
         buffer.length = bytes_read + 1;
+        scope.AddBytes(bytes_read);
+
+        Lseek(&active->file, loc);
         return bytes_read;
     }
     return 0;
@@ -356,10 +1612,11 @@ size_t SDCard::ReadLine(UniqueArray<char>& buffer, bool from_start_of_line)
 
 size_t SDCard::WriteBuffer(const void* buffer, size_t max_bytes)
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_WRITE);
     if (is_file_open)
     {
-        UINT bytes_written;
-        f_write(&file, buffer, max_bytes, &bytes_written);
+        size_t bytes_written = WriteData(buffer, max_bytes);
+        scope.AddBytes(bytes_written);
         return bytes_written;
     }
     return 0;
@@ -367,32 +1624,41 @@ size_t SDCard::WriteBuffer(const void* buffer, size_t max_bytes)
 
 size_t SDCard::WriteString(const char* strbuff)
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_WRITE);
     if (is_file_open)
     {
-        f_puts(strbuff, &file);
-        return strlen(strbuff) + 1;
+        size_t len = strlen(strbuff);
+        scope.AddBytes(WriteData(strbuff, len));
+        return len + 1;
     }
     return 0;
 }
 
 size_t SDCard::WriteCharacter(char c)
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_WRITE);
     if (is_file_open)
     {
-        f_putc(c, &file);
-        return 1;
+        size_t bytes_written = WriteData(&c, 1);
+        scope.AddBytes(bytes_written);
+        return bytes_written;
     }
     return 0;
 }
 
 size_t SDCard::AppendBuffer(const void* buffer, size_t max_bytes, bool keep_index)
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_APPEND);
     if (is_file_open)
     {
-        UINT bytes_written;
-        uint64_t prev_pos = f_tell(&file);
-        f_lseek(&file, f_size(&file));
-        f_write(&file, buffer, max_bytes, &bytes_written);
+        EndStream();
+        FlushWriteBuffer();
+        uint64_t prev_pos = f_tell(&active->file);
+        Lseek(&active->file, f_size(&active->file));
+        size_t bytes_written = WriteData(buffer, max_bytes);
+        scope.AddBytes(bytes_written);
+        if (keep_index)
+            Seek(prev_pos);
         return bytes_written;
     }
     return 0;
@@ -400,311 +1666,186 @@ size_t SDCard::AppendBuffer(const void* buffer, size_t max_bytes, bool keep_inde
 
 size_t SDCard::AppendString(const char* strbuff, bool keep_index)
 {
-    if (is_file_open)
-    {
-        UINT bytes_written;
-        uint64_t prev_pos = f_tell(&file);
-        f_lseek(&file, f_size(&file));
-        f_puts(strbuff, &file);
-        if (keep_index)
-            f_lseek(&file, prev_pos);
-        
-        return bytes_written;
-    }
-    return 0;
+    return AppendBuffer(strbuff, strlen(strbuff), keep_index);
 }
 
 size_t SDCard::AppendCharacter(char c, bool keep_index)
 {
-    if (is_file_open)
-    {
-        UINT bytes_written;
-        uint64_t prev_pos = f_tell(&file);
-        f_lseek(&file, f_size(&file));
-        f_putc(c, &file);
-        if (keep_index)
-            f_lseek(&file, prev_pos);
-
-        return bytes_written;
-    }
-    return 0;
+    return AppendBuffer(&c, 1, keep_index);
 }
 
 int64_t SDCard::FindNextBuffer(const void* buffer, size_t max_bytes, bool keep_index)
 {
-    if (is_file_open)
-    {
-        uint64_t loc = f_tell(&file);
-
-        uint8_t buffer_cmp[max_bytes];
-        UINT bytes_read;
-        f_read(&file, buffer_cmp, max_bytes, &bytes_read); // fill buffer, will be right at the prev fileptr
-        SeekStep(1 - bytes_read); // trace back to original position and shift over one
-        while (1)
-        {
-            uint8_t b;
-            f_read(&file, &b, 1, &bytes_read); // read byte
-            memmove(buffer_cmp, buffer_cmp + 1, max_bytes); // shift buffer to the left
-            buffer_cmp[max_bytes - 1] = b;
-
-            if (memcmp(buffer, buffer_cmp, max_bytes) != 0)
-            {
-                if (f_eof(&file))
-                {
-                    return -1; // not found
-                }
-            }
-            else
-                break;
-        }
-        SeekStep(-max_bytes); // move back to beginning of buffer
-        uint64_t found = f_tell(&file);
-        if (keep_index)
-            f_lseek(&file, loc); // go back to original position
-        return found;
-    }
-    return -1;
+    return FindNext(buffer, max_bytes, keep_index);
 }
 
 int64_t SDCard::FindNextString(const char* str, bool keep_index)
 {
-    if (is_file_open)
-    {
-        uint64_t loc = f_tell(&file);
-
-        size_t len = strlen(str); // no plus one, as f_read does not add a null terminator
-        char str_cmp[len];
-        UINT bytes_read;
-        f_read(&file, str_cmp, len, &bytes_read);
-        SeekStep(1 - bytes_read);
-        while (1)
-        {
-            char c;
-            f_read(&file, &c, 1, &bytes_read);
-            memmove(str_cmp, str_cmp + 1, len);
-            str_cmp[len - 1] = c;
-
-            if (strncmp(str, str_cmp, len) != 0)
-            {
-                if (f_eof(&file))
-                    return -1;
-            }
-            else
-                break;
-        }
-        SeekStep(-len);
-        uint64_t found = f_tell(&file);
-        if (keep_index)
-            f_lseek(&file, loc);
-        return found;
-    }
-    return -1;
+    return FindNext(str, strlen(str), keep_index); // no null terminator, it is not in the file
 }
 
 int64_t SDCard::FindNextCharacter(char c, bool keep_index)
 {
-    if (is_file_open)
-    {
-        uint64_t loc = f_tell(&file);
-        
-        UINT bytes_read;
-        SeekStep(1);
-        while (1)
-        {
-            char c_read;
-            f_read(&file, &c_read, 1, &bytes_read);
-
-            if (c_read != c)
-            {
-                if (f_eof(&file))
-                    return -1;
-            }
-            else
-                break;
-        }
-        SeekStep(-1);
-        uint64_t found = f_tell(&file);
-        if (keep_index)
-            f_lseek(&file, loc);
-        return found;
-    }
-    return -1;
+    return FindNext(&c, 1, keep_index);
 }
 
 int64_t SDCard::FindPreviousBuffer(const void* buffer, size_t max_bytes, bool keep_index)
 {
-    if (is_file_open)
-    {
-        uint64_t loc = f_tell(&file);
-        
-        uint8_t buffer_cmp[max_bytes];
-        UINT bytes_read;
-        f_read(&file, buffer_cmp, max_bytes, &bytes_read); // fill the buffer first (will be right at the fptr)
-        SeekStep(-bytes_read - 1); // move back to original and one additional position to read individual chars in loop
-        while (1)
-        {
-            uint8_t b;
-            f_read(&file, &b, 1, &bytes_read);
-            memmove(buffer_cmp + 1, buffer_cmp, max_bytes); // shift buffer once to the right
-            buffer_cmp[0] = b;
-            SeekStep(-1); // f_read contradicts. moves it back where it was before read
-        
-            if (memcmp(buffer, buffer_cmp, max_bytes) != 0)
-            {
-                if (f_tell(&file) == 0)
-                    return -1;
-                
-                SeekStep(-1); // after a check for zero, move back again for reading before the last
-            }
-            else
-                break;
-        }
-        uint64_t found = f_tell(&file);
-        if (keep_index)
-            f_lseek(&file, loc);
-        return found;
-    }
-    return -1;
+    return FindPrevious(buffer, max_bytes, keep_index);
 }
 
 int64_t SDCard::FindPreviousString(const char* str, bool keep_index)
 {
-    if (is_file_open)
-    {
-        uint64_t loc = f_tell(&file);
+    return FindPrevious(str, strlen(str), keep_index);
+}
 
-        size_t len = strlen(str);
-        char str_cmp[len];
-        UINT bytes_read;
-        f_read(&file, str_cmp, len, &bytes_read);
-        SeekStep(-bytes_read - 1);
-        while (1)
-        {
-            char c;
-            f_read(&file, &c, 1, &bytes_read);
-            memmove(str_cmp + 1, str_cmp, len);
-            str_cmp[0] = c;
-            SeekStep(-1);
+int64_t SDCard::FindPreviousCharacter(char c, bool keep_index)
+{
+    return FindPrevious(&c, 1, keep_index);
+}
 
-            if (strncmp(str, str_cmp, len) != 0)
-            {
-                if (f_tell(&file) == 0)
-                    return -1;
+bool SDCard::ClearFile(uint64_t begin_index, uint64_t end_index)
+{
+    Range range = {begin_index, end_index};
+    return ClearRanges(&range, 1);
+}
 
-                SeekStep(-1);
-            }
-            else
-                break;
-        }
-        uint64_t found = f_tell(&file);
-        f_lseek(&file, loc);
-        return found;
+bool SDCard::ClearFile(uint64_t begin_index)
+{
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_CLEAR);
+    if (is_file_open)
+    {
+        EndStream();
+        FlushWriteBuffer();
+        uint64_t prev_pos = f_tell(&active->file);
+        Lseek(&active->file, begin_index);
+        bool result = f_truncate(&active->file) == FR_OK;
+
+        if (prev_pos > begin_index) // if previous index was in a spot just deleted
+            Lseek(&active->file, f_size(&active->file));
+        else
+            Lseek(&active->file, prev_pos);
+        return result;
     }
-    return -1;
+    return false;
 }
 
-int64_t SDCard::FindPreviousCharacter(char c, bool keep_index)
+bool SDCard::ClearRanges(Range* ranges, size_t count)
 {
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_CLEAR);
     if (is_file_open)
     {
-        uint64_t loc = f_tell(&file);
-
-        UINT bytes_read;
-        SeekStep(-1);
-        while (1)
+        EndStream();
+        FlushWriteBuffer();
+        uint64_t size = f_size(&active->file);
+        uint64_t prev_pos = f_tell(&active->file);
+
+        // sort, clamp and merge so the file can be compacted front to back in one pass
+        std::sort(ranges, ranges + count, [](const Range& a, const Range& b) {
+            return a.begin_index < b.begin_index;
+        });
+        size_t merged = 0;
+        for (size_t i = 0; i < count; i++)
         {
-            char c_cmp;
-            f_read(&file, &c_cmp, 1, &bytes_read);
-            SeekStep(-1);
+            Range r = ranges[i];
+            r.end_index = r.end_index > size ? size : r.end_index;
+            if (r.begin_index >= r.end_index)
+                continue;
 
-            if (c != c_cmp)
+            if (merged && r.begin_index <= ranges[merged - 1].end_index)
             {
-                if (f_tell(&file) == 0)
-                    return -1;
-
-                SeekStep(-1);
+                if (r.end_index > ranges[merged - 1].end_index)
+                    ranges[merged - 1].end_index = r.end_index;
             }
             else
-                break;
+                ranges[merged++] = r;
         }
-        uint64_t found = f_tell(&file);
-        if (keep_index)
-            f_lseek(&file, loc);
-        return found;
-    }
-    return -1;
-}
-
-bool SDCard::ClearFile(uint64_t begin_index, uint64_t end_index)
-{
-    if (is_file_open)
-    {   
-        uint64_t size = f_size(&file);
-        end_index = end_index > size ? size : end_index;
-        
-        uint64_t prev_pos = f_tell(&file);
-        f_lseek(&file, begin_index);
-
-        if (end_index == size)
-            return f_truncate(&file) == FR_OK;
-
-        size_t diff = size - end_index;
-        char buff[diff];
-        UINT bytes_read;
-        f_read(&file, buff, diff, &bytes_read);
+        if (merged == 0)
+            return true;
+
+        // Slide every kept segment down over the removed bytes through the scratch block.
+        // Pieces are sized so each write ends on a sector boundary, then the file is truncated once.
+        bool ok = true;
+        uint64_t write_pos = ranges[0].begin_index;
+        uint64_t removed_before_prev = 0;
+        for (size_t i = 0; i < merged && ok; i++)
+        {
+            uint64_t read_pos = ranges[i].end_index;
+            uint64_t segment_end = i + 1 < merged ? ranges[i + 1].begin_index : size;
 
-        f_lseek(&file, begin_index);
-        FRESULT result = f_truncate(&file);
+            if (prev_pos >= ranges[i].end_index)
+                removed_before_prev += ranges[i].end_index - ranges[i].begin_index;
+            else if (prev_pos > ranges[i].begin_index)
+                removed_before_prev += prev_pos - ranges[i].begin_index; // it was inside a removed range
 
-        UINT bytes_written;
-        f_write(&file, buff, diff, &bytes_written);
+            while (read_pos < segment_end)
+            {
+                size_t to_copy = block_buffer_size - write_pos % FF_MIN_SS;
+                if (to_copy > segment_end - read_pos)
+                    to_copy = segment_end - read_pos;
 
-        return result;
-    }
-    return false;
-}
+                UINT bytes_read, bytes_written;
+                if (Lseek(&active->file, read_pos) != FR_OK || f_read(&active->file, block_buffer, to_copy, &bytes_read) != FR_OK || bytes_read != to_copy
+                    || Lseek(&active->file, write_pos) != FR_OK || f_write(&active->file, block_buffer, to_copy, &bytes_written) != FR_OK || bytes_written != to_copy)
+                {
+                    ok = false;
+                    break;
+                }
+                read_pos += to_copy;
+                write_pos += to_copy;
+            }
+        }
 
-bool SDCard::ClearFile(uint64_t begin_index)
-{
-    if (is_file_open)
-    {
-        uint64_t prev_pos = f_tell(&file);
-        f_lseek(&file, begin_index);
-        f_truncate(&file);
+        if (ok)
+            ok = Lseek(&active->file, write_pos) == FR_OK && f_truncate(&active->file) == FR_OK;
 
-        if (prev_pos > begin_index) // if previous index was in a spot just deleted
-            f_lseek(&file, f_size(&file));
-        else
-            f_lseek(&file, prev_pos);
+        Lseek(&active->file, prev_pos - removed_before_prev);
+        return ok;
     }
     return false;
 }
 
 bool SDCard::Delete(const char* file_path)
 {
-    if (strcmp(current_file_path, file_path) == 0)
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_DELETE);
+    for (FileSlot& slot : file_slots)
     {
-        f_close(&file);
-        is_file_open = false;
-        return f_unlink(current_file_path) == FR_OK;
+        if (slot.is_open && slot.path && strcmp(slot.path, file_path) == 0)
+        {
+            slot.write_buffered = 0; // the file is going away, nothing left to flush
+            slot.is_open = false;
+            f_close(&slot.file);
+        }
     }
-    return f_unlink(file_path) == FR_OK;
+    is_file_open = active->is_open;
+    InvalidateStatCache(); // may be a directory with cached entries below it
+    if (f_unlink(file_path) != FR_OK)
+        return false;
+    NoteRemoved(file_path);
+    return true;
 }
 
 bool SDCard::Delete()
 {
-    if (is_file_open)
+    SDCardMetrics::Scope scope(metrics, SDCardMetrics::OP_DELETE);
+    if (active->is_open)
     {
-        f_close(&file);
+        active->write_buffered = 0;
+        f_close(&active->file);
+        active->is_open = false;
         is_file_open = false;
     }
-    return f_unlink(current_file_path) == FR_OK;
+    InvalidateStatCache();
+    if (f_unlink(active->path) != FR_OK)
+        return false;
+    NoteRemoved(active->path);
+    return true;
 }
 
 bool SDCard::Exists(const char* path) const
 {
     FILINFO info;
-    return f_stat(path, &info) == FR_OK;
+    return CachedStat(path, &info) == FR_OK;
 }
 
 size_t __attribute__((weak)) sd_get_num()
@@ -719,9 +1860,87 @@ sd_card_t* __attribute__((weak)) sd_get_by_num(size_t num)
     return nullptr;
 }
 
+SDCard::DirectoryIterator::DirectoryIterator(const char* dir_path, const DirectoryFilter& filter)
+    : filter(filter)
+{
+    is_open = f_opendir(&dir, dir_path) == FR_OK;
+}
+
+SDCard::DirectoryIterator::~DirectoryIterator()
+{
+    if (is_open)
+        f_closedir(&dir);
+}
+
+bool SDCard::DirectoryIterator::Next()
+{
+    while (is_open)
+    {
+        if (f_readdir(&dir, &info) != FR_OK || info.fname[0] == 0)
+        {
+            f_closedir(&dir);
+            is_open = false;
+            break;
+        }
+
+        if (MatchesFilter(info, filter))
+            return true;
+    }
+    return false;
+}
+
+bool SDCard::DirectoryIterator::Next(DirectoryEntry& entry)
+{
+    if (!Next())
+        return false;
+
+    entry = GetEntryFromFatFsStat(info);
+    return true;
+}
+
+#ifndef PICO_SD_HOST
+// Shared by the detector's IRQ and whoever drains the event queue, on either core.
+static critical_section_t detect_lock;
+
+alignas(SDCardDetectEvent) static uint8_t detect_event_pool[SDCardDetectEvent::pool_size][sizeof(SDCardDetectEvent)];
+static uint32_t detect_event_pool_used = 0; // one bit per entry
+
+void* SDCardDetectEvent::operator new(size_t size) noexcept
+{
+    void* ptr = nullptr;
+    critical_section_enter_blocking(&detect_lock);
+    for (size_t i = 0; i < pool_size; i++)
+    {
+        if (!(detect_event_pool_used & (1u << i)))
+        {
+            detect_event_pool_used |= 1u << i;
+            ptr = detect_event_pool[i];
+            break;
+        }
+    }
+    critical_section_exit(&detect_lock);
+    return ptr;
+}
+
+// The queue hands events back as Event*, so only a virtual destructor gets their delete here.
+static_assert(std::has_virtual_destructor_v<Event>);
+
+void SDCardDetectEvent::operator delete(void* ptr) noexcept
+{
+    if (!ptr)
+        return;
+
+    size_t i = ((uint8_t*)ptr - &detect_event_pool[0][0]) / sizeof(SDCardDetectEvent);
+    critical_section_enter_blocking(&detect_lock);
+    detect_event_pool_used &= ~(1u << i);
+    critical_section_exit(&detect_lock);
+}
+
 SDCardDetector::SDCardDetector(uint8_t gpio_pin, SDCard* card, bool auto_mount)
 : GPIODeviceDebounce(gpio_pin, Pull::DOWN, GPIO_IRQ_EDGE_RISE | GPIO_IRQ_EDGE_FALL, 100), card(card), auto_mount(auto_mount)
 {
+    if (!critical_section_is_initialized(&detect_lock))
+        critical_section_init(&detect_lock);
     //card->card.use_card_detect = true;
     //card->card.card_detect_gpio = gpio_pin;
 }
@@ -730,18 +1949,80 @@ void SDCardDetector::HandleIRQ(uint32_t events_triggered_mask)
 {
     if (event_mask & events_triggered_mask)
     {
+        uint32_t start = time_us_32();
         if (debouncer.Allow())
         {
-            Event* ev = new GPIOEvent(this, events_triggered_mask);
-            ProcessImmediateActions(ev);
-            queue_try_add(&Event::event_queue, &ev);
-            if (card && auto_mount)
+            Event* ev = new SDCardDetectEvent(this, events_triggered_mask);
+            if (ev)
+            {
+                ProcessImmediateActions(ev);
+                if (!queue_try_add(&Event::event_queue, &ev))
+                {
+                    delete ev;
+                    irq_stats.events_dropped++;
+                }
+            }
+            else
             {
-                if (events_triggered_mask & GPIO_IRQ_EDGE_RISE)
-                    card->Mount();
-                else if (events_triggered_mask & GPIO_IRQ_EDGE_FALL)
-                    card->Unmount();
+                irq_stats.events_dropped++;
             }
+
+            // Service may run on the other core
+            critical_section_enter_blocking(&detect_lock);
+            if (events_triggered_mask & GPIO_IRQ_EDGE_FALL)
+                removed = true; // stays set when a rise follows before Service, the card was still swapped
+            if (events_triggered_mask & GPIO_IRQ_EDGE_RISE)
+                pending = PENDING_MOUNT;
+            else if (events_triggered_mask & GPIO_IRQ_EDGE_FALL)
+                pending = PENDING_UNMOUNT;
+            critical_section_exit(&detect_lock);
         }
+
+        uint32_t elapsed = time_us_32() - start;
+        irq_stats.irq_count++;
+        irq_stats.total_irq_us += elapsed;
+        if (elapsed > irq_stats.max_irq_us)
+            irq_stats.max_irq_us = elapsed;
+    }
+}
+
+bool SDCardDetector::Service()
+{
+    critical_section_enter_blocking(&detect_lock);
+    PendingAction action = pending;
+    bool was_removed = removed;
+    pending = PENDING_NONE;
+    removed = false;
+    critical_section_exit(&detect_lock);
+
+    if (!card || !auto_mount || action == PENDING_NONE)
+        return false;
+
+    // A falling edge comes with every removal, even one the card was put back in after before
+    // this call, maybe another card. Its dirty sectors have nowhere to go, so they are dropped
+    // rather than written out by the Unmount, which drops the rest of the cached state.
+    if (was_removed)
+    {
+        SDCardSectorCache::Invalidate(card);
+        card->Unmount();
     }
-}
\ No newline at end of file
+    if (action == PENDING_MOUNT)
+        card->Mount();
+    return true;
+}
+
+SDCardDetector::IRQStatistics SDCardDetector::GetIRQStatistics() const
+{
+    critical_section_enter_blocking(&detect_lock);
+    IRQStatistics stats = irq_stats;
+    critical_section_exit(&detect_lock);
+    return stats;
+}
+
+void SDCardDetector::ResetIRQStatistics()
+{
+    critical_section_enter_blocking(&detect_lock);
+    irq_stats = {};
+    critical_section_exit(&detect_lock);
+}
+#endif
\ No newline at end of file
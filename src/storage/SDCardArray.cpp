@@ -0,0 +1,775 @@
+#include <storage/SDCardArray.h>
+
+#include "SDCardTime.h"
+
+#include <stdio.h>
+
+#ifndef PICO_SD_HOST
+#include <pico/multicore.h>
+#include <hardware/sync.h>
+
+SDCardArray* SDCardArray::core1_array = nullptr;
+
+void SDCardArray::Core1Entry()
+{
+    core1_array->Work();
+    while (true)
+        __wfe(); // Stop resets the core
+}
+#endif
+
+SDCardArray::SDCardArray(SDCard* const* cards, size_t card_count, Mode mode, uint32_t stripe_size)
+    : StorageDevice(), card_count(card_count < max_cards ? card_count : max_cards), mode(mode), stripe_size(stripe_size)
+{
+    for (size_t i = 0; i < this->card_count; i++)
+        this->cards[i] = cards[i];
+}
+
+SDCardArray::~SDCardArray()
+{
+    Stop();
+    CloseFile();
+}
+
+void SDCardArray::Wake()
+{
+#ifndef PICO_SD_HOST
+    __sev();
+#endif
+}
+
+void SDCardArray::Idle()
+{
+#ifdef PICO_SD_HOST
+    std::this_thread::yield();
+#else
+    __wfe();
+#endif
+}
+
+bool SDCardArray::Start()
+{
+    if (IsRunning() || card_count < 2 || !SDCard::ClaimCore1(this))
+        return false;
+
+    stop_requested.store(false, std::memory_order_relaxed);
+    requested.store(sequence, std::memory_order_relaxed);
+    completed.store(sequence, std::memory_order_relaxed);
+    worker_running.store(true, std::memory_order_release);
+#ifdef PICO_SD_HOST
+    worker = std::thread([this]() { Work(); });
+#else
+    core1_array = this;
+    multicore_reset_core1();
+    multicore_launch_core1(&Core1Entry);
+#endif
+    return true;
+}
+
+bool SDCardArray::Stop()
+{
+    if (!IsRunning())
+        return false;
+
+    stop_requested.store(true, std::memory_order_release);
+    Wake();
+#ifdef PICO_SD_HOST
+    worker.join();
+#else
+    while (IsRunning())
+        tight_loop_contents();
+    multicore_reset_core1();
+    core1_array = nullptr;
+#endif
+    SDCard::ReleaseCore1(this);
+    return true;
+}
+
+void SDCardArray::Work()
+{
+    uint32_t done = completed.load(std::memory_order_relaxed);
+    while (!stop_requested.load(std::memory_order_acquire))
+    {
+        uint32_t request = requested.load(std::memory_order_acquire);
+        if (request == done)
+        {
+            Idle();
+            continue;
+        }
+
+        RunShares(1);
+        done = request;
+        completed.store(done, std::memory_order_release);
+        Wake();
+    }
+    worker_running.store(false, std::memory_order_release);
+}
+
+uint64_t SDCardArray::MemberOffset(size_t index, uint64_t logical) const
+{
+    if (mode == Mode::MIRRORED)
+        return logical;
+
+    uint64_t stripe = logical / stripe_size;
+    uint64_t row = stripe / card_count;
+    size_t column = stripe % card_count;
+    if (index < column)
+        return (row + 1) * stripe_size; // its stripe of this row is already behind
+    if (index == column)
+        return row * stripe_size + logical % stripe_size;
+    return row * stripe_size;
+}
+
+const char* SDCardArray::MemberPath(size_t index, const char* path, char* out) const
+{
+    int length = snprintf(out, path_length, "%s%s", cards[index]->pc_name, path);
+    return length >= 0 && (size_t)length < path_length ? out : nullptr;
+}
+
+void SDCardArray::RunShares(int parity)
+{
+    for (size_t i = 0; i < card_count; i++)
+    {
+        if (parity < 0 || (int)(i % 2) == parity)
+            RunShare(i);
+    }
+}
+
+void SDCardArray::RunShare(size_t index)
+{
+    uint32_t start = NowUs();
+    SDCard* card = cards[index];
+    uint64_t end = transfer.position + transfer.bytes;
+    transfer_end[index] = end;
+
+    if (transfer.op == Op::FLUSH)
+    {
+        if (!card->Flush())
+            transfer_end[index] = transfer.position;
+    }
+    else if (mode == Mode::STRIPED)
+    {
+        // the card's stripes in the range follow each other in its copy of the file
+        uint64_t q = transfer.position;
+        if (!card->Seek(MemberOffset(index, q)))
+            transfer_end[index] = q;
+
+        while (q < transfer_end[index])
+        {
+            size_t n = stripe_size - q % stripe_size;
+            n = n < end - q ? n : end - q;
+            if ((q / stripe_size) % card_count == index)
+            {
+                uint8_t* data = transfer.data + (q - transfer.position);
+                size_t done = transfer.op == Op::READ ? card->ReadBuffer(data, n) : card->WriteBuffer(data, n);
+                if (done != n)
+                {
+                    transfer_end[index] = q + done;
+                    break;
+                }
+            }
+            q += n;
+        }
+    }
+    else if (transfer.op == Op::WRITE)
+    {
+        size_t done = card->Seek(transfer.position) ? card->WriteBuffer(transfer.data, transfer.bytes) : 0;
+        transfer_end[index] = transfer.position + done;
+    }
+    else if (transfer.part ? index * transfer.part < transfer.bytes : index == transfer.reader)
+    {
+        size_t offset = transfer.part ? index * transfer.part : 0;
+        size_t n = transfer.part ? transfer.part : transfer.bytes;
+        n = n < transfer.bytes - offset ? n : transfer.bytes - offset;
+
+        size_t done = card->Seek(transfer.position + offset) ? card->ReadBuffer(transfer.data + offset, n) : 0;
+        if (done != n)
+            transfer_end[index] = transfer.position + offset + done;
+    }
+
+    stats.busy_us[index] += NowUs() - start;
+}
+
+size_t SDCardArray::Run(Op op, uint8_t* data, size_t bytes)
+{
+    transfer.op = op;
+    transfer.data = data;
+    transfer.position = position;
+    transfer.bytes = bytes;
+    transfer.part = 0;
+    transfer.reader = 0;
+
+    // is there anything for more than one card to do at the same time
+    bool shared = card_count > 1;
+    if (op != Op::FLUSH && mode == Mode::STRIPED)
+        shared = shared && position % stripe_size + bytes > stripe_size;
+    else if (op == Op::READ && mode == Mode::MIRRORED)
+    {
+        if (IsRunning() && shared && bytes >= (size_t)stripe_size * card_count)
+        {
+            transfer.part = (bytes + card_count - 1) / card_count;
+            transfer.part = (transfer.part + FF_MIN_SS - 1) / FF_MIN_SS * FF_MIN_SS;
+        }
+        else
+        {
+            if (position != last_read_end || position % FF_MIN_SS == 0)
+                last_reader = (last_reader + 1) % card_count;
+            transfer.reader = last_reader;
+            last_read_end = position + bytes;
+            shared = false;
+        }
+    }
+
+    if (shared && IsRunning())
+    {
+        requested.store(++sequence, std::memory_order_release);
+        Wake();
+        RunShares(0);
+        while (completed.load(std::memory_order_acquire) != sequence)
+            Idle();
+        stats.parallel_transfers++;
+    }
+    else
+    {
+        RunShares(-1);
+        stats.serial_transfers++;
+    }
+
+    uint64_t end = position + bytes;
+    for (size_t i = 0; i < card_count; i++)
+        end = transfer_end[i] < end ? transfer_end[i] : end;
+    return end - position;
+}
+
+bool SDCardArray::Flush()
+{
+    // moves no data, so each card that synced counts as having done the one byte
+    return is_file_open && Run(Op::FLUSH, nullptr, 1) == 1;
+}
+
+UniqueArray<DirectoryEntry> SDCardArray::PeekDirectory(const char* dir_path) const
+{
+    char path[path_length];
+    return MemberPath(0, dir_path, path) ? cards[0]->PeekDirectory(path) : nullptr;
+}
+
+size_t SDCardArray::GetTotalCountInDirectory(const char* dir_path) const
+{
+    char path[path_length];
+    return MemberPath(0, dir_path, path) ? cards[0]->GetTotalCountInDirectory(path) : 0;
+}
+
+size_t SDCardArray::GetFileCountInDirectory(const char* dir_path) const
+{
+    char path[path_length];
+    return MemberPath(0, dir_path, path) ? cards[0]->GetFileCountInDirectory(path) : 0;
+}
+
+size_t SDCardArray::GetDirectoryCountInDirectory(const char* dir_path) const
+{
+    char path[path_length];
+    return MemberPath(0, dir_path, path) ? cards[0]->GetDirectoryCountInDirectory(path) : 0;
+}
+
+DirectoryEntry SDCardArray::GetDirectoryEntry(const char* path) const
+{
+    char member_path[path_length];
+    return MemberPath(0, path, member_path) ? cards[0]->GetDirectoryEntry(member_path) : DirectoryEntry{};
+}
+
+bool SDCardArray::ChangeDirectory(const char* path)
+{
+    char member_path[path_length];
+    bool result = true;
+    for (size_t i = 0; i < card_count; i++)
+        result = MemberPath(i, path, member_path) && cards[i]->ChangeDirectory(member_path) && result;
+    return result;
+}
+
+bool SDCardArray::CreateDirectory(const char* dir_path)
+{
+    char path[path_length];
+    bool result = true;
+    for (size_t i = 0; i < card_count; i++)
+        result = MemberPath(i, dir_path, path) && cards[i]->CreateDirectory(path) && result;
+    return result;
+}
+
+bool SDCardArray::Rename(const char* name, const char* new_name)
+{
+    // FatFs takes the drive from the first path only
+    char path[path_length];
+    bool result = true;
+    for (size_t i = 0; i < card_count; i++)
+        result = MemberPath(i, name, path) && cards[i]->Rename(path, new_name) && result;
+    return result;
+}
+
+bool SDCardArray::Mount()
+{
+    if (is_mounted)
+        return false;
+
+    for (size_t i = 0; i < card_count; i++)
+    {
+        if (!cards[i]->Mount())
+        {
+            while (i--)
+                cards[i]->Unmount();
+            return false;
+        }
+    }
+    is_mounted = true;
+    return true;
+}
+
+bool SDCardArray::Unmount()
+{
+    if (!is_mounted)
+        return false;
+
+    CloseFile();
+    bool result = true;
+    for (size_t i = 0; i < card_count; i++)
+        result = cards[i]->Unmount() && result;
+    is_mounted = false;
+    return result;
+}
+
+bool SDCardArray::OpenFile(const char* file_path, uint32_t access_mask)
+{
+    CloseFile();
+    for (size_t i = 0; i < card_count; i++)
+    {
+        if (!MemberPath(i, file_path, open_paths[i]) || !cards[i]->OpenFile(open_paths[i], access_mask))
+        {
+            while (i--)
+                cards[i]->CloseFile();
+            return false;
+        }
+    }
+
+    is_file_open = true;
+    position = access_mask & OPEN_APPEND ? GetFileSize() : 0;
+    return true;
+}
+
+bool SDCardArray::CloseFile()
+{
+    if (!is_file_open)
+        return false;
+
+    bool result = true;
+    for (size_t i = 0; i < card_count; i++)
+        result = cards[i]->CloseFile() && result;
+    is_file_open = false;
+    return result;
+}
+
+bool SDCardArray::Seek(uint64_t index)
+{
+    if (is_file_open)
+    {
+        // the cards only follow on the next transfer
+        uint64_t size = GetFileSize();
+        position = index > size ? size : index;
+        return true;
+    }
+    return false;
+}
+
+bool SDCardArray::SeekStart()
+{
+    return Seek(0);
+}
+
+bool SDCardArray::SeekEnd()
+{
+    return Seek(GetFileSize());
+}
+
+bool SDCardArray::SeekStep(int64_t d_idx)
+{
+    if (d_idx < 0 && (uint64_t)-d_idx > position)
+        return false;
+    return Seek(position + d_idx);
+}
+
+uint64_t SDCardArray::GetFileSize(const char* path) const
+{
+    char member_path[path_length];
+    uint64_t size = 0;
+    for (size_t i = 0; i < card_count; i++)
+    {
+        uint64_t member_size = MemberPath(i, path, member_path) ? cards[i]->GetFileSize(member_path) : 0;
+        if (mode == Mode::STRIPED)
+            size += member_size;
+        else if (i == 0 || member_size < size)
+            size = member_size;
+    }
+    return size;
+}
+
+uint64_t SDCardArray::GetFileSize() const
+{
+    if (!is_file_open)
+        return 0;
+
+    uint64_t size = 0;
+    for (size_t i = 0; i < card_count; i++)
+    {
+        uint64_t member_size = cards[i]->GetFileSize();
+        if (mode == Mode::STRIPED)
+            size += member_size;
+        else if (i == 0 || member_size < size)
+            size = member_size;
+    }
+    return size;
+}
+
+uint64_t SDCardArray::GetFreeSpace() const
+{
+    uint64_t free = 0;
+    for (size_t i = 0; i < card_count; i++)
+    {
+        uint64_t member_free = cards[i]->GetFreeSpace();
+        free = i == 0 || member_free < free ? member_free : free;
+    }
+    return mode == Mode::STRIPED ? free * card_count : free;
+}
+
+uint64_t SDCardArray::GetTotalSpace() const
+{
+    uint64_t total = 0;
+    for (size_t i = 0; i < card_count; i++)
+    {
+        uint64_t member_total = cards[i]->GetTotalSpace();
+        total = i == 0 || member_total < total ? member_total : total;
+    }
+    return mode == Mode::STRIPED ? total * card_count : total;
+}
+
+float SDCardArray::GetSpaceUsedPercentage() const
+{
+    uint64_t total = GetTotalSpace();
+    if (total == 0)
+        return 0.f;
+    return ((total - GetFreeSpace()) / (float)total) * 100.f;
+}
+
+size_t SDCardArray::ReadBuffer(void* buffer, size_t max_bytes)
+{
+    if (is_file_open)
+    {
+        size_t bytes_read = Run(Op::READ, (uint8_t*)buffer, max_bytes);
+        position += bytes_read;
+        return bytes_read;
+    }
+    return 0;
+}
+
+char SDCardArray::ReadCharacter()
+{
+    char c = '\0';
+    ReadBuffer(&c, 1);
+    return c;
+}
+
+size_t SDCardArray::ReadAll(UniqueArray<char>& buffer)
+{
+    if (is_file_open)
+    {
+        uint64_t size = GetFileSize();
+        size_t remaining = size > position ? size - position : 0;
+        buffer.array = std::make_unique<char[]>(remaining);
+        buffer.length = ReadBuffer(buffer.array.get(), remaining);
+        return buffer.length;
+    }
+    return 0;
+}
+
+size_t SDCardArray::ReadLine(UniqueArray<char>& buffer, bool from_start_of_line)
+{
+    if (is_file_open)
+    {
+        if (from_start_of_line)
+            position = FindPreviousCharacter('\n') + 1;
+
+        uint64_t start = position;
+        size_t capacity = buffer.array ? buffer.length : 0;
+        size_t length = 0;
+        while (1)
+        {
+            if (length + 1 >= capacity) // grow, keeping room for the terminator
+            {
+                size_t new_capacity = capacity < 64 ? 128 : capacity * 2;
+                std::unique_ptr<char[]> grown = std::make_unique<char[]>(new_capacity);
+                if (length)
+                    memcpy(grown.get(), buffer.array.get(), length);
+                buffer.array = std::move(grown);
+                capacity = new_capacity;
+            }
+
+            size_t to_read = FF_MIN_SS < capacity - 1 - length ? FF_MIN_SS : capacity - 1 - length;
+            size_t bytes_read = ReadBuffer(buffer.array.get() + length, to_read);
+            if (bytes_read == 0)
+                break;
+
+            char* newline = (char*)memchr(buffer.array.get() + length, '\n', bytes_read);
+            if (newline)
+            {
+                length = newline - buffer.array.get() + 1; // keeps the newline, like SDCard::ReadLine
+                position = start + length;
+                break;
+            }
+            length += bytes_read;
+        }
+        buffer.array[length] = '\0';
+        buffer.length = capacity;
+        return length;
+    }
+    return 0;
+}
+
+size_t SDCardArray::WriteBuffer(const void* buffer, size_t max_bytes)
+{
+    if (is_file_open)
+    {
+        size_t bytes_written = Run(Op::WRITE, (uint8_t*)buffer, max_bytes);
+        position += bytes_written;
+        return bytes_written;
+    }
+    return 0;
+}
+
+size_t SDCardArray::WriteString(const char* str)
+{
+    if (is_file_open)
+    {
+        size_t len = strlen(str);
+        WriteBuffer(str, len);
+        return len + 1;
+    }
+    return 0;
+}
+
+size_t SDCardArray::WriteCharacter(char c)
+{
+    return WriteBuffer(&c, 1);
+}
+
+size_t SDCardArray::AppendBuffer(const void* buffer, size_t max_bytes, bool keep_index)
+{
+    if (is_file_open)
+    {
+        uint64_t prev_pos = position;
+        position = GetFileSize();
+        size_t bytes_written = WriteBuffer(buffer, max_bytes);
+        if (keep_index)
+            position = prev_pos;
+        return bytes_written;
+    }
+    return 0;
+}
+
+size_t SDCardArray::AppendString(const char* str, bool keep_index)
+{
+    return AppendBuffer(str, strlen(str), keep_index);
+}
+
+size_t SDCardArray::AppendCharacter(char c, bool keep_index)
+{
+    return AppendBuffer(&c, 1, keep_index);
+}
+
+int64_t SDCardArray::ScanForward(const void* pattern, size_t length, uint64_t start)
+{
+    // patterns have to fit twice into the scratch block, as with SDCard's own block buffer
+    if (length == 0 || length > sizeof(block_buffer) / 2 || start + length > GetFileSize())
+        return -1;
+
+    // The last length - 1 bytes of each block are carried over so matches across block edges are found.
+    position = start;
+    uint64_t buff_pos = start; // logical offset of block_buffer[0]
+    size_t filled = 0;
+    while (1)
+    {
+        size_t bytes_read = ReadBuffer(block_buffer + filled, sizeof(block_buffer) - filled);
+        filled += bytes_read;
+
+        const uint8_t* match = SDCard::FindInBlock(block_buffer, filled, (const uint8_t*)pattern, length);
+        if (match)
+            return buff_pos + (match - block_buffer);
+
+        if (bytes_read == 0)
+            return -1; // end of file
+
+        size_t carry = filled < length - 1 ? filled : length - 1;
+        memmove(block_buffer, block_buffer + filled - carry, carry);
+        buff_pos += filled - carry;
+        filled = carry;
+    }
+}
+
+int64_t SDCardArray::ScanBackward(const void* pattern, size_t length, uint64_t before)
+{
+    if (length == 0 || length > sizeof(block_buffer) / 2 || before == 0)
+        return -1;
+
+    // a match may start anywhere before the offset and run on past it
+    uint64_t size = GetFileSize();
+    uint64_t region_end = before - 1 + length;
+    region_end = region_end > size ? size : region_end;
+    if (region_end < length)
+        return -1;
+
+    // Each block is read in front of the first length - 1 bytes of the block after it.
+    uint64_t data_end = region_end;
+    size_t carry = 0;
+    while (1)
+    {
+        size_t to_read = sizeof(block_buffer) - carry;
+        uint64_t read_pos = data_end > to_read ? data_end - to_read : 0;
+        to_read = data_end - read_pos;
+
+        memmove(block_buffer + to_read, block_buffer, carry);
+        position = read_pos;
+        if (ReadBuffer(block_buffer, to_read) != to_read)
+            return -1;
+        size_t filled = to_read + carry;
+
+        const uint8_t* match = SDCard::FindLastInBlock(block_buffer, filled, (const uint8_t*)pattern, length);
+        if (match)
+            return read_pos + (match - block_buffer);
+
+        if (read_pos == 0)
+            return -1; // start of file
+
+        carry = filled < length - 1 ? filled : length - 1;
+        data_end = read_pos;
+    }
+}
+
+int64_t SDCardArray::Find(const void* pattern, size_t length, bool forward, bool keep_index)
+{
+    if (!is_file_open)
+        return -1;
+
+    uint64_t loc = position;
+    int64_t found = forward ? ScanForward(pattern, length, loc + 1) : ScanBackward(pattern, length, loc);
+
+    if (keep_index)
+        position = loc;
+    else if (found >= 0)
+        position = found;
+    else
+        position = forward ? GetFileSize() : 0;
+    return found;
+}
+
+int64_t SDCardArray::FindNextBuffer(const void* buffer, size_t max_bytes, bool keep_index)
+{
+    return Find(buffer, max_bytes, true, keep_index);
+}
+
+int64_t SDCardArray::FindNextString(const char* str, bool keep_index)
+{
+    return Find(str, strlen(str), true, keep_index);
+}
+
+int64_t SDCardArray::FindNextCharacter(char c, bool keep_index)
+{
+    return Find(&c, 1, true, keep_index);
+}
+
+int64_t SDCardArray::FindPreviousBuffer(const void* buffer, size_t max_bytes, bool keep_index)
+{
+    return Find(buffer, max_bytes, false, keep_index);
+}
+
+int64_t SDCardArray::FindPreviousString(const char* str, bool keep_index)
+{
+    return Find(str, strlen(str), false, keep_index);
+}
+
+int64_t SDCardArray::FindPreviousCharacter(char c, bool keep_index)
+{
+    return Find(&c, 1, false, keep_index);
+}
+
+bool SDCardArray::ClearFile(uint64_t begin_index, uint64_t end_index)
+{
+    if (!is_file_open)
+        return false;
+
+    uint64_t size = GetFileSize();
+    end_index = end_index > size ? size : end_index;
+    if (begin_index >= end_index)
+        return true;
+
+    // Striped data cannot be cut out card by card, so the rest of the file moves forward
+    // through the scratch block, every card working on its stripes of each piece.
+    uint64_t prev_pos = position;
+    uint64_t read_pos = end_index;
+    uint64_t write_pos = begin_index;
+    bool ok = true;
+    while (ok && read_pos < size)
+    {
+        size_t n = sizeof(block_buffer) < size - read_pos ? sizeof(block_buffer) : size - read_pos;
+        position = read_pos;
+        ok = ReadBuffer(block_buffer, n) == n;
+        position = write_pos;
+        ok = ok && WriteBuffer(block_buffer, n) == n;
+        read_pos += n;
+        write_pos += n;
+    }
+    ok = ok && ClearFile(write_pos);
+
+    uint64_t removed = end_index - begin_index;
+    if (prev_pos >= end_index)
+        position = prev_pos - removed;
+    else
+        position = prev_pos > begin_index ? begin_index : prev_pos;
+    return ok;
+}
+
+bool SDCardArray::ClearFile(uint64_t begin_index)
+{
+    if (!is_file_open)
+        return false;
+
+    bool result = true;
+    for (size_t i = 0; i < card_count; i++)
+    {
+        // a card whose copy ends before its cut has nothing to lose, and seeking there would grow it
+        uint64_t member_end = MemberOffset(i, begin_index);
+        if (member_end < cards[i]->GetFileSize())
+            result = cards[i]->ClearFile(member_end) && result;
+    }
+    position = position > begin_index ? begin_index : position;
+    return result;
+}
+
+bool SDCardArray::Delete(const char* file_path)
+{
+    char path[path_length];
+    bool result = true;
+    for (size_t i = 0; i < card_count; i++)
+        result = MemberPath(i, file_path, path) && cards[i]->Delete(path) && result;
+    return result;
+}
+
+bool SDCardArray::Delete()
+{
+    bool result = true;
+    for (size_t i = 0; i < card_count; i++)
+        result = cards[i]->Delete() && result;
+    is_file_open = false;
+    return result;
+}
+
+bool SDCardArray::Exists(const char* path) const
+{
+    char member_path[path_length];
+    return MemberPath(0, path, member_path) && cards[0]->Exists(member_path);
+}
\ No newline at end of file
@@ -0,0 +1,196 @@
+#include <storage/SDCardAsyncIO.h>
+
+#ifdef PICO_SD_HOST
+#include <chrono>
+#else
+#include <pico/multicore.h>
+#include <hardware/sync.h>
+
+SDCardIOEvent::SDCardIOEvent(SDCardAsyncIO* source, uint32_t request_id, void* buffer, size_t bytes, bool is_write, bool ok)
+    : Event(source), request_id(request_id), buffer(buffer), bytes(bytes), is_write(is_write), ok(ok)
+{
+}
+
+SDCardAsyncIO* SDCardAsyncIO::core1_io = nullptr;
+
+void SDCardAsyncIO::Core1Entry()
+{
+    core1_io->Work();
+    while (true)
+        __wfe(); // Stop resets the core
+}
+#endif
+
+static uint32_t NextId(uint32_t id)
+{
+    id++;
+    return id == SDCardAsyncIO::invalid_request ? id + 1 : id;
+}
+
+SDCardAsyncIO::SDCardAsyncIO(SDCard& card)
+    : card(&card)
+{
+}
+
+SDCardAsyncIO::~SDCardAsyncIO()
+{
+    Stop();
+}
+
+SDCardAsyncIO::Request& SDCardAsyncIO::Slot(uint32_t id)
+{
+    return requests[id % queue_depth];
+}
+
+void SDCardAsyncIO::Wake()
+{
+#ifndef PICO_SD_HOST
+    __sev();
+#endif
+}
+
+void SDCardAsyncIO::Idle()
+{
+#ifdef PICO_SD_HOST
+    std::this_thread::sleep_for(std::chrono::microseconds(50));
+#else
+    __wfe();
+#endif
+}
+
+bool SDCardAsyncIO::Start()
+{
+    if (IsRunning() || !SDCard::ClaimCore1(this))
+        return false;
+
+    stop_requested.store(false, std::memory_order_relaxed);
+    worker_running.store(true, std::memory_order_release);
+#ifdef PICO_SD_HOST
+    worker = std::thread([this]() { Work(); });
+#else
+    core1_io = this;
+    multicore_reset_core1();
+    multicore_launch_core1(&Core1Entry);
+#endif
+    return true;
+}
+
+bool SDCardAsyncIO::Stop()
+{
+    if (!IsRunning())
+    {
+        while (Service());
+        return true;
+    }
+
+    stop_requested.store(true, std::memory_order_release);
+    Wake();
+#ifdef PICO_SD_HOST
+    worker.join();
+#else
+    while (IsRunning())
+        tight_loop_contents();
+    multicore_reset_core1();
+    core1_io = nullptr;
+#endif
+    SDCard::ReleaseCore1(this);
+    return true;
+}
+
+uint32_t SDCardAsyncIO::Submit(SDCard::FileHandle handle, void* buffer, size_t size, bool is_write)
+{
+    Request& request = Slot(next_id);
+    if (request.state.load(std::memory_order_acquire) == QUEUED)
+        return invalid_request;
+
+    request.id = next_id;
+    request.handle = handle;
+    request.buffer = buffer;
+    request.size = size;
+    request.result = 0;
+    request.is_write = is_write;
+    request.state.store(QUEUED, std::memory_order_release);
+
+    next_id = NextId(next_id);
+    Wake();
+    return request.id;
+}
+
+uint32_t SDCardAsyncIO::ReadAsync(SDCard::FileHandle handle, void* buffer, size_t max_bytes)
+{
+    return Submit(handle, buffer, max_bytes, false);
+}
+
+uint32_t SDCardAsyncIO::WriteAsync(SDCard::FileHandle handle, const void* buffer, size_t max_bytes)
+{
+    return Submit(handle, const_cast<void*>(buffer), max_bytes, true);
+}
+
+bool SDCardAsyncIO::IsDone(uint32_t request_id) const
+{
+    const Request& request = requests[request_id % queue_depth];
+    // a slot that moved on to a later request finished this one long ago
+    return request.id != request_id || request.state.load(std::memory_order_acquire) == DONE;
+}
+
+size_t SDCardAsyncIO::Wait(uint32_t request_id)
+{
+    if (request_id == invalid_request)
+        return 0;
+
+    while (!IsDone(request_id))
+    {
+        if (!IsRunning())
+            Service();
+#ifdef PICO_SD_HOST
+        else
+            std::this_thread::yield();
+#endif
+    }
+
+    Request& request = Slot(request_id);
+    return request.id == request_id ? request.result : 0;
+}
+
+bool SDCardAsyncIO::Service()
+{
+    Request& request = Slot(next_serviced);
+    // state first, the other fields are only settled once it reads QUEUED
+    if (request.state.load(std::memory_order_acquire) != QUEUED || request.id != next_serviced)
+        return false;
+
+    if (request.is_write)
+        request.result = card->WriteBuffer(request.handle, request.buffer, request.size);
+    else
+        request.result = card->ReadBuffer(request.handle, request.buffer, request.size);
+
+#ifndef PICO_SD_HOST
+    // built before the slot is released, the submitter may refill it right after
+    bool ok = request.is_write ? request.result == request.size : request.result > 0 || request.size == 0;
+    Event* ev = new SDCardIOEvent(this, request.id, request.buffer, request.result, request.is_write, ok);
+#endif
+    request.state.store(DONE, std::memory_order_release);
+    next_serviced = NextId(next_serviced);
+
+#ifndef PICO_SD_HOST
+    ProcessImmediateActions(ev);
+    if (!queue_try_add(&Event::event_queue, &ev))
+    {
+        delete ev;
+        events_dropped.store(events_dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    }
+#endif
+    return true;
+}
+
+void SDCardAsyncIO::Work()
+{
+    while (!stop_requested.load(std::memory_order_acquire))
+    {
+        if (!Service())
+            Idle();
+    }
+
+    while (Service());
+    worker_running.store(false, std::memory_order_release);
+}
\ No newline at end of file
@@ -0,0 +1,236 @@
+#include <storage/SDCardAsyncWriter.h>
+
+#ifdef PICO_SD_HOST
+#include <chrono>
+#else
+#include <pico/multicore.h>
+#include <hardware/sync.h>
+
+SDCardAsyncWriter* SDCardAsyncWriter::core1_writer = nullptr;
+
+void SDCardAsyncWriter::Core1Entry()
+{
+    core1_writer->Consume();
+    while (true)
+        __wfe(); // Close resets the core
+}
+#endif
+
+static bool IsPowerOfTwo(size_t n)
+{
+    return n && (n & (n - 1)) == 0;
+}
+
+SDCardAsyncWriter::SDCardAsyncWriter(SDCard& card, void* ring, size_t ring_size, size_t chunk_size)
+    : card(&card), ring((uint8_t*)ring), ring_size(ring_size), chunk_size(chunk_size)
+{
+}
+
+SDCardAsyncWriter::~SDCardAsyncWriter()
+{
+    Close();
+}
+
+void SDCardAsyncWriter::Wake()
+{
+#ifndef PICO_SD_HOST
+    __sev();
+#endif
+}
+
+void SDCardAsyncWriter::Idle()
+{
+#ifdef PICO_SD_HOST
+    std::this_thread::sleep_for(std::chrono::microseconds(100));
+#else
+    __wfe();
+#endif
+}
+
+bool SDCardAsyncWriter::Open(const char* path, uint32_t access_mask)
+{
+    if (IsOpen() || !ring || !IsPowerOfTwo(ring_size) || !IsPowerOfTwo(chunk_size)
+        || chunk_size < FF_MIN_SS || chunk_size > ring_size / 2)
+        return false;
+
+    handle = card->OpenHandle(path, access_mask);
+    if (handle == SDCard::invalid_handle)
+        return false;
+
+    // appending starts mid-chunk, so the first chunk is short and the rest land aligned
+    align_offset = (size_t)(f_tell(&card->file_slots[handle].file) & (chunk_size - 1));
+    head.store(0, std::memory_order_relaxed);
+    tail.store(0, std::memory_order_relaxed);
+    flush_requested.store(false, std::memory_order_relaxed);
+    stop_requested.store(false, std::memory_order_relaxed);
+    return true;
+}
+
+bool SDCardAsyncWriter::Start()
+{
+    if (!IsOpen() || IsRunning() || !SDCard::ClaimCore1(this))
+        return false;
+
+    consumer_running.store(true, std::memory_order_release);
+#ifdef PICO_SD_HOST
+    consumer = std::thread([this]() { Consume(); });
+#else
+    core1_writer = this;
+    multicore_reset_core1();
+    multicore_launch_core1(&Core1Entry);
+#endif
+    return true;
+}
+
+bool SDCardAsyncWriter::Close()
+{
+    if (!IsOpen())
+        return false;
+
+    bool result = true;
+    if (IsRunning())
+    {
+        stop_requested.store(true, std::memory_order_release);
+        Wake();
+#ifdef PICO_SD_HOST
+        consumer.join();
+#else
+        while (IsRunning())
+            tight_loop_contents();
+        multicore_reset_core1();
+        core1_writer = nullptr;
+#endif
+        SDCard::ReleaseCore1(this);
+    }
+    else
+    {
+        result = Drain(true);
+    }
+
+    result = card->CloseHandle(handle) && result;
+    handle = SDCard::invalid_handle;
+    return result;
+}
+
+bool SDCardAsyncWriter::Push(const void* data, size_t size)
+{
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t used = h - tail.load(std::memory_order_acquire);
+    if (!IsOpen() || size > ring_size - used)
+    {
+        overflows.store(overflows.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        dropped_bytes.store(dropped_bytes.load(std::memory_order_relaxed) + (uint32_t)size, std::memory_order_relaxed);
+        return false;
+    }
+
+    size_t offset = h & (ring_size - 1);
+    size_t first = size < ring_size - offset ? size : ring_size - offset;
+    memcpy(ring + offset, data, first);
+    memcpy(ring, (const uint8_t*)data + first, size - first);
+
+    head.store(h + size, std::memory_order_release);
+    if (used + size > high_water.load(std::memory_order_relaxed))
+        high_water.store((uint32_t)(used + size), std::memory_order_relaxed);
+
+    Wake();
+    return true;
+}
+
+void SDCardAsyncWriter::RequestFlush()
+{
+    flush_requested.store(true, std::memory_order_release);
+    Wake();
+}
+
+bool SDCardAsyncWriter::Drain(bool all)
+{
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+
+    while (h != t)
+    {
+        // Stop at the next chunk boundary of the file, or at the end of the ring memory.
+        // The ring is a whole number of chunks, so the end of the ring is a boundary too
+        // as long as the file started aligned.
+        size_t end = h;
+        if (!all)
+        {
+            end = ((align_offset + h) & ~(chunk_size - 1)) - align_offset;
+            if ((ptrdiff_t)(end - t) <= 0)
+                return true; // less than a chunk waiting
+        }
+
+        size_t offset = t & (ring_size - 1);
+        size_t n = end - t;
+        n = n < ring_size - offset ? n : ring_size - offset;
+
+        size_t written = card->WriteBuffer(handle, ring + offset, n);
+        t += written;
+        tail.store(t, std::memory_order_release);
+
+        if (written != n)
+        {
+            write_errors.store(write_errors.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+            return false;
+        }
+        chunks_written.store(chunks_written.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+
+        h = head.load(std::memory_order_acquire);
+    }
+    return true;
+}
+
+bool SDCardAsyncWriter::Service()
+{
+    if (!IsOpen())
+        return false;
+
+    // Cleared before draining, so a request made meanwhile is kept for the next pass.
+    // (exchange would need LDREX/STREX, which the M0+ does not have.)
+    if (flush_requested.load(std::memory_order_acquire))
+    {
+        flush_requested.store(false, std::memory_order_release);
+        return Drain(true) && card->Flush(handle);
+    }
+    return Drain(false);
+}
+
+void SDCardAsyncWriter::Consume()
+{
+    while (!stop_requested.load(std::memory_order_acquire))
+    {
+        size_t pending = GetPending();
+        if (pending < chunk_size && !flush_requested.load(std::memory_order_acquire))
+        {
+            Idle();
+            continue;
+        }
+        if (!Service())
+            Idle(); // the card failed, the data stays queued for the next try
+    }
+
+    // what is left after the stop, partial chunk included
+    if (Drain(true))
+        card->Flush(handle);
+    consumer_running.store(false, std::memory_order_release);
+}
+
+SDCardAsyncWriter::Statistics SDCardAsyncWriter::GetStatistics() const
+{
+    Statistics stats;
+    stats.high_water = high_water.load(std::memory_order_relaxed);
+    stats.overflows = overflows.load(std::memory_order_relaxed);
+    stats.dropped_bytes = dropped_bytes.load(std::memory_order_relaxed);
+    stats.chunks_written = chunks_written.load(std::memory_order_relaxed);
+    stats.write_errors = write_errors.load(std::memory_order_relaxed);
+    return stats;
+}
+
+void SDCardAsyncWriter::ResetStatistics()
+{
+    high_water.store(0, std::memory_order_relaxed);
+    overflows.store(0, std::memory_order_relaxed);
+    dropped_bytes.store(0, std::memory_order_relaxed);
+    chunks_written.store(0, std::memory_order_relaxed);
+    write_errors.store(0, std::memory_order_relaxed);
+}
\ No newline at end of file
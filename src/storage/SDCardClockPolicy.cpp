@@ -0,0 +1,55 @@
+#include <storage/SDCardClockPolicy.h>
+
+SDCardClockPolicy::SDCardClockPolicy(const Config& config)
+{
+    Reset(config);
+}
+
+void SDCardClockPolicy::Reset(const Config& config)
+{
+    this->config = config;
+    rate = config.start_hz;
+    recent_errors = 0;
+    consecutive_successes = 0;
+    backoff_shift = 0;
+}
+
+bool SDCardClockPolicy::Record(Outcome outcome)
+{
+    switch (outcome)
+    {
+    case Outcome::OK:
+        // a clean run forgives earlier errors, even where the clock cannot go any higher
+        if (++consecutive_successes >= config.successes_to_step_up)
+            recent_errors = 0;
+        if (rate >= config.max_hz || consecutive_successes < (config.successes_to_step_up << backoff_shift))
+            return false;
+
+        consecutive_successes = 0;
+        rate = rate + config.step_hz > config.max_hz ? config.max_hz : rate + config.step_hz;
+        counters.step_ups++;
+        return true;
+
+    case Outcome::CRC_ERROR:
+    case Outcome::TIMEOUT:
+        if (outcome == Outcome::CRC_ERROR)
+            counters.crc_errors++;
+        else
+            counters.timeouts++;
+
+        consecutive_successes = 0;
+        if (++recent_errors < config.errors_to_step_down || rate <= config.min_hz)
+            return false;
+
+        recent_errors = 0;
+        rate = rate < config.min_hz + config.step_hz ? config.min_hz : rate - config.step_hz;
+        if (backoff_shift < max_backoff_shift)
+            backoff_shift++;
+        counters.step_downs++;
+        return true;
+
+    default:
+        counters.other_errors++;
+        return false;
+    }
+}
\ No newline at end of file
@@ -0,0 +1,141 @@
+#include <storage/SDCardContiguousWriter.h>
+
+// The "directory entry needs writing" flag of a FIL. FatFs keeps it private to ff.c.
+static constexpr BYTE fa_modified = 0x40;
+
+SDCardContiguousWriter::SDCardContiguousWriter(SDCard& card)
+    : card(&card)
+{
+}
+
+SDCardContiguousWriter::~SDCardContiguousWriter()
+{
+    Close();
+}
+
+FIL& SDCardContiguousWriter::File()
+{
+    return card->file_slots[handle].file;
+}
+
+bool SDCardContiguousWriter::Open(const char* path, uint64_t bytes)
+{
+#if FF_USE_EXPAND
+    if (IsOpen() || bytes == 0)
+        return false;
+
+    handle = card->OpenHandle(path, StorageDevice::WRITE | StorageDevice::CREATE_OVERWRITE);
+    if (handle == SDCard::invalid_handle)
+        return false;
+
+    if (f_expand(&File(), bytes, 1) != FR_OK)
+    {
+        card->CloseHandle(handle);
+        handle = SDCard::invalid_handle;
+        return false;
+    }
+
+    // the clusters are one run, so the file's data is one run of sectors from here
+    FATFS* fs = File().obj.fs;
+    first_sector = fs->database + (LBA_t)fs->csize * (File().obj.sclust - 2);
+    capacity = bytes;
+    written = 0;
+    buffered = 0;
+    return true;
+#else
+    return false; // needs FF_USE_EXPAND in ffconf.h
+#endif
+}
+
+size_t SDCardContiguousWriter::Write(const void* data, size_t size)
+{
+    if (!IsOpen())
+        return 0;
+
+    uint64_t space = capacity - written - buffered;
+    size = size > space ? space : size;
+
+    const uint8_t* src = (const uint8_t*)data;
+    size_t remaining = size;
+
+    // top up the partial sector first
+    if (buffered)
+    {
+        size_t n = FF_MIN_SS - buffered;
+        n = remaining < n ? remaining : n;
+        memcpy(sector_buffer + buffered, src, n);
+        buffered += n;
+        src += n;
+        remaining -= n;
+
+        if (buffered < FF_MIN_SS)
+            return size;
+
+        if (!card->WriteSectors(sector_buffer, first_sector + written / FF_MIN_SS, 1))
+            return size - remaining; // stays buffered, the next call tries again
+        written += FF_MIN_SS;
+        buffered = 0;
+    }
+
+    // then every whole sector in one transfer, straight from the caller's memory
+    uint32_t sectors = remaining / FF_MIN_SS;
+    if (sectors)
+    {
+        if (!card->WriteSectors(src, first_sector + written / FF_MIN_SS, sectors))
+            return size - remaining;
+        written += (uint64_t)sectors * FF_MIN_SS;
+        src += (size_t)sectors * FF_MIN_SS;
+        remaining -= (size_t)sectors * FF_MIN_SS;
+    }
+
+    memcpy(sector_buffer, src, remaining);
+    buffered = remaining;
+    return size;
+}
+
+bool SDCardContiguousWriter::Checkpoint()
+{
+    if (!IsOpen())
+        return false;
+
+    // The partial sector goes out padded; the next Write rewrites it once it fills up.
+    if (buffered)
+    {
+        memset(sector_buffer + buffered, 0, FF_MIN_SS - buffered);
+        if (!card->WriteSectors(sector_buffer, first_sector + written / FF_MIN_SS, 1))
+            return false;
+    }
+
+    // Let f_sync write the entry with the size written so far. The clusters past it stay allocated.
+    FIL& file = File();
+    file.obj.objsize = written + buffered;
+    file.flag |= fa_modified;
+    bool result = f_sync(&file) == FR_OK;
+    file.obj.objsize = capacity;
+    return result;
+}
+
+bool SDCardContiguousWriter::Close()
+{
+    if (!IsOpen())
+        return false;
+
+    bool result = true;
+    if (buffered)
+    {
+        memset(sector_buffer + buffered, 0, FF_MIN_SS - buffered);
+        result = card->WriteSectors(sector_buffer, first_sector + written / FF_MIN_SS, 1);
+        written += buffered;
+        buffered = 0;
+    }
+
+    // trim to what was written, which hands the unused clusters back
+    FIL& file = File();
+    file.obj.objsize = capacity;
+    result = f_lseek(&file, written) == FR_OK && f_truncate(&file) == FR_OK && result;
+    result = card->CloseHandle(handle) && result;
+
+    handle = SDCard::invalid_handle;
+    capacity = 0;
+    return result;
+}
@@ -0,0 +1,44 @@
+#include <storage/SDCardDirectoryListing.h>
+
+SDCardDirectoryListing::SDCardDirectoryListing(size_t budget)
+    : owned_memory(std::make_unique<uint8_t[]>(budget)), memory(owned_memory.get()), budget(budget)
+{
+    Clear(0);
+}
+
+SDCardDirectoryListing::SDCardDirectoryListing(void* memory, size_t budget)
+    : memory((uint8_t*)memory), budget(budget)
+{
+    Clear(0);
+}
+
+void SDCardDirectoryListing::Clear(size_t first)
+{
+    // caller memory may come unaligned
+    size_t skip = (alignof(Entry) - (uintptr_t)memory % alignof(Entry)) % alignof(Entry);
+    entries = (Entry*)(memory + (skip < budget ? skip : budget));
+    count = 0;
+    names_begin = budget;
+    this->first = first;
+    more = false;
+}
+
+bool SDCardDirectoryListing::Add(const FILINFO& info)
+{
+    size_t name_length = strlen(info.fname);
+    size_t entries_end = (uint8_t*)(entries + count + 1) - memory;
+    if (entries_end > names_begin || names_begin - entries_end < name_length + 1)
+        return false;
+
+    names_begin -= name_length + 1;
+    memcpy(memory + names_begin, info.fname, name_length + 1);
+
+    Entry& entry = entries[count++];
+    entry.size = info.fsize;
+    entry.name_offset = names_begin;
+    entry.name_length = name_length;
+    entry.date_modified = info.fdate;
+    entry.time_modified = info.ftime;
+    entry.attributes = info.fattrib;
+    return true;
+}
\ No newline at end of file
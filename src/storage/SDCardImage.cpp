@@ -0,0 +1,195 @@
+#include <storage/SDCardImage.h>
+
+#include <chrono>
+#include <thread>
+
+SDCardImage* SDCardImage::FromCard(sd_card_t* sd_card_p)
+{
+    return static_cast<SDCardImage*>(sd_card_p->image_if_p);
+}
+
+DSTATUS SDCardImage::Init(sd_card_t* sd_card_p)
+{
+    SDCardImage* inst = FromCard(sd_card_p);
+    if (inst->image)
+        sd_card_p->state.m_Status &= ~STA_NOINIT;
+    else
+        sd_card_p->state.m_Status |= STA_NOINIT | STA_NODISK;
+
+    inst->ChargeCommand(0, 0);
+    return sd_card_p->state.m_Status;
+}
+
+void SDCardImage::Deinit(sd_card_t* sd_card_p)
+{
+    sd_card_p->state.m_Status |= STA_NOINIT;
+}
+
+block_dev_err_t SDCardImage::ReadBlocks(sd_card_t* sd_card_p, uint8_t* buffer, uint64_t sector, uint32_t count)
+{
+    SDCardImage* inst = FromCard(sd_card_p);
+    if (sector + count > sd_card_p->state.sectors)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+
+    block_dev_err_t link_error = inst->InjectLinkError();
+    if (link_error != SD_BLOCK_DEVICE_ERROR_NONE)
+        return link_error;
+
+    inst->StopTransfer();
+    inst->stats.read_commands++;
+    inst->stats.sectors_read += count;
+    inst->ChargeCommand((uint64_t)count * FF_MIN_SS, inst->timing.read_bytes_per_sec);
+
+    if (fseeko(inst->image, (off_t)(sector * FF_MIN_SS), SEEK_SET) != 0)
+        return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
+    if (fread(buffer, FF_MIN_SS, count, inst->image) != count)
+        return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
+    return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+block_dev_err_t SDCardImage::WriteBlocks(sd_card_t* sd_card_p, const uint8_t* buffer, uint64_t sector, uint32_t count)
+{
+    SDCardImage* inst = FromCard(sd_card_p);
+    if (sector + count > sd_card_p->state.sectors)
+        return SD_BLOCK_DEVICE_ERROR_PARAMETER;
+
+    block_dev_err_t link_error = inst->InjectLinkError();
+    if (link_error != SD_BLOCK_DEVICE_ERROR_NONE)
+        return link_error;
+
+    inst->stats.sectors_written += count;
+    if (inst->write_open && sector == inst->write_end)
+    {
+        // continues the open multi-block write, no new command
+        inst->ChargeTransfer((uint64_t)count * FF_MIN_SS, inst->timing.write_bytes_per_sec);
+    }
+    else
+    {
+        inst->StopTransfer();
+        inst->stats.write_commands++;
+        inst->ChargeCommand((uint64_t)count * FF_MIN_SS, inst->timing.write_bytes_per_sec);
+    }
+    inst->write_open = true;
+    inst->write_end = sector + count;
+
+    if (fseeko(inst->image, (off_t)(sector * FF_MIN_SS), SEEK_SET) != 0)
+        return SD_BLOCK_DEVICE_ERROR_WRITE;
+    if (fwrite(buffer, FF_MIN_SS, count, inst->image) != count)
+        return SD_BLOCK_DEVICE_ERROR_WRITE;
+    return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+block_dev_err_t SDCardImage::Sync(sd_card_t* sd_card_p)
+{
+    SDCardImage* inst = FromCard(sd_card_p);
+    inst->StopTransfer();
+    inst->stats.sync_commands++;
+    inst->ChargeCommand(0, 0);
+    return fflush(inst->image) == 0 ? SD_BLOCK_DEVICE_ERROR_NONE : SD_BLOCK_DEVICE_ERROR_WRITE;
+}
+
+uint64_t SDCardImage::GetNumSectors(sd_card_t* sd_card_p)
+{
+    return sd_card_p->state.sectors;
+}
+
+void SDCardImage::ChargeCommand(uint64_t bytes, uint32_t bytes_per_sec)
+{
+    ChargeTransfer(bytes, bytes_per_sec, timing.command_latency_us);
+}
+
+void SDCardImage::ChargeTransfer(uint64_t bytes, uint32_t bytes_per_sec, uint64_t us)
+{
+    if (bytes_per_sec)
+        us += bytes * 1000000 / bytes_per_sec;
+
+    stats.busy_us += us;
+    if (timing.real_time && us)
+        std::this_thread::sleep_for(std::chrono::microseconds(us));
+}
+
+void SDCardImage::StopTransfer()
+{
+    if (!write_open)
+        return;
+
+    // STOP_TRAN plus the busy wait while the card commits the run
+    write_open = false;
+    stats.stop_commands++;
+    ChargeCommand(0, 0);
+}
+
+block_dev_err_t SDCardImage::InjectLinkError()
+{
+    if (!link.error_every || !link.clean_up_to_hz || bus_hz <= link.clean_up_to_hz)
+        return SD_BLOCK_DEVICE_ERROR_NONE;
+    if (++link_transfers % link.error_every != 0)
+        return SD_BLOCK_DEVICE_ERROR_NONE;
+
+    // the command went out and the data was garbled or never came, which ends any open transfer
+    StopTransfer();
+    stats.link_errors++;
+    ChargeCommand(0, 0);
+    return link.timeouts ? SD_BLOCK_DEVICE_ERROR_NO_RESPONSE : SD_BLOCK_DEVICE_ERROR_CRC;
+}
+
+bool SDCardImage::SetBusClock(uint32_t hz)
+{
+    bus_hz = hz;
+    return true;
+}
+
+SDCardImage::SDCardImage(const char* image_path, uint64_t image_size, const char* pc_name)
+    : SDCard(pc_name), image_path(image_path), image_size(image_size)
+{
+    image = fopen(image_path, "r+b");
+    if (!image && image_size)
+    {
+        image = fopen(image_path, "w+b");
+        if (image && (fseeko(image, (off_t)image_size - 1, SEEK_SET) != 0 || fputc(0, image) == EOF))
+        {
+            fclose(image);
+            image = nullptr;
+        }
+    }
+
+    if (image)
+    {
+        fseeko(image, 0, SEEK_END);
+        this->image_size = (uint64_t)ftello(image);
+    }
+
+    card.type = SD_IF_NONE;
+    card.image_if_p = this;
+    card.state.m_Status = STA_NOINIT;
+    card.state.sectors = this->image_size / FF_MIN_SS;
+    card.init = &Init;
+    card.deinit = &Deinit;
+    card.read_blocks = &ReadBlocks;
+    card.write_blocks = &WriteBlocks;
+    card.sync = &Sync;
+    card.get_num_sectors = &GetNumSectors;
+
+    // an SD bus at default speed: from 400 kHz up to 25 MHz, starting halfway, in 2.5 MHz steps
+    SetClockConfig({400 * 1000, 12500 * 1000, 25 * 1000 * 1000, 2500 * 1000, 3, 1000});
+}
+
+SDCardImage::~SDCardImage()
+{
+    // The base destructor would still flush through the image, so finish with it here.
+    CloseFile();
+    Unmount();
+
+    if (image)
+        fclose(image);
+}
+
+bool SDCardImage::Format()
+{
+    if (is_mounted || !image)
+        return false;
+
+    static uint8_t work[FF_MAX_SS * 8];
+    MKFS_PARM opt = {FM_ANY, 0, 0, 0, 0};
+    return f_mkfs(pc_name, &opt, work, sizeof(work)) == FR_OK;
+}
\ No newline at end of file
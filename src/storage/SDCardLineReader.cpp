@@ -0,0 +1,68 @@
+#include <storage/SDCardLineReader.h>
+
+SDCardLineReader::SDCardLineReader(SDCard& card, size_t window_size)
+    : card(&card), owned_window(std::make_unique<char[]>(window_size)), capacity(window_size)
+{
+    window = owned_window.get();
+}
+
+SDCardLineReader::SDCardLineReader(SDCard& card, char* window, size_t window_size)
+    : card(&card), window(window), capacity(window_size)
+{
+}
+
+bool SDCardLineReader::ReadLine(std::string_view& line)
+{
+    while (1)
+    {
+        char* newline = (char*)memchr(window + begin, '\n', end - begin);
+        if (newline)
+        {
+            size_t length = newline - (window + begin);
+            if (length && newline[-1] == '\r')
+                length--;
+            line = std::string_view(window + begin, length);
+            begin = newline - window + 1;
+            continued = false;
+            return true;
+        }
+
+        if (eof)
+        {
+            if (begin == end)
+                return false;
+
+            line = std::string_view(window + begin, end - begin); // last line had no newline
+            begin = end;
+            continued = false;
+            return true;
+        }
+
+        if (begin == 0 && end == capacity)
+        {
+            // no newline in a full window, hand it out as a piece of a longer line
+            line = std::string_view(window, capacity);
+            begin = end;
+            continued = true;
+            return true;
+        }
+
+        // move what is left to the front and fill the rest of the window
+        memmove(window, window + begin, end - begin);
+        end -= begin;
+        begin = 0;
+
+        size_t bytes_read = card->ReadBuffer(window + end, capacity - end);
+        if (bytes_read == 0)
+            eof = true;
+        end += bytes_read;
+    }
+}
+
+void SDCardLineReader::Reset()
+{
+    begin = 0;
+    end = 0;
+    eof = false;
+    continued = false;
+}
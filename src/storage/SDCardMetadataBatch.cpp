@@ -0,0 +1,90 @@
+#include <storage/SDCardMetadataBatch.h>
+#include <storage/SDCardSectorCache.h>
+
+SDCardMetadataBatch::SDCardMetadataBatch(SDCard& card)
+    : card(&card)
+{
+}
+
+bool SDCardMetadataBatch::StorePath(const char* path, uint16_t& offset)
+{
+    size_t length = strlen(path) + 1;
+    if (paths_used + length > path_space)
+        return false;
+
+    memcpy(paths + paths_used, path, length);
+    offset = paths_used;
+    paths_used += length;
+    return true;
+}
+
+bool SDCardMetadataBatch::Queue(Op op, const char* path, const char* new_path)
+{
+    if (count == max_operations)
+        return false;
+
+    Operation& operation = operations[count];
+    size_t paths_before = paths_used;
+    if (!StorePath(path, operation.path) || (new_path && !StorePath(new_path, operation.new_path)))
+    {
+        paths_used = paths_before;
+        return false;
+    }
+
+    operation.op = op;
+    operation.done = false;
+    count++;
+    return true;
+}
+
+bool SDCardMetadataBatch::CreateDirectory(const char* dir_path)
+{
+    return Queue(Op::CREATE_DIRECTORY, dir_path);
+}
+
+bool SDCardMetadataBatch::Rename(const char* name, const char* new_name)
+{
+    return Queue(Op::RENAME, name, new_name);
+}
+
+bool SDCardMetadataBatch::Move(const char* path, const char* new_path)
+{
+    return Queue(Op::RENAME, path, new_path);
+}
+
+bool SDCardMetadataBatch::Delete(const char* path)
+{
+    return Queue(Op::DELETE, path);
+}
+
+bool SDCardMetadataBatch::Commit()
+{
+    // FatFs syncs after each of these; while writes are held, those syncs stop at the cache
+    SDCardSectorCache::HoldWrites(card);
+    bool result = true;
+    for (size_t i = 0; i < count; i++)
+    {
+        Operation& operation = operations[i];
+        const char* path = paths + operation.path;
+        switch (operation.op)
+        {
+        case Op::CREATE_DIRECTORY:
+            operation.done = card->CreateDirectory(path);
+            break;
+        case Op::RENAME:
+            operation.done = card->Rename(path, paths + operation.new_path);
+            break;
+        case Op::DELETE:
+            operation.done = card->Delete(path);
+            break;
+        }
+        result = operation.done && result;
+    }
+    return SDCardSectorCache::ReleaseWrites(card) && result;
+}
+
+void SDCardMetadataBatch::Clear()
+{
+    count = 0;
+    paths_used = 0;
+}
\ No newline at end of file
@@ -0,0 +1,117 @@
+#include <storage/SDCardMetrics.h>
+
+#include "SDCardTime.h"
+
+#include <stdio.h>
+
+static const char* const operation_names[SDCardMetrics::OP_COUNT] = {
+    "mount",
+    "unmount",
+    "open",
+    "close",
+    "read",
+    "read_line",
+    "write",
+    "append",
+    "seek",
+    "flush",
+    "find_next",
+    "find_previous",
+    "clear",
+    "stat",
+    "directory",
+    "change_directory",
+    "create_directory",
+    "rename",
+    "delete",
+    "free_space",
+    "block_read",
+    "block_write",
+    "block_sync"
+};
+
+const char* SDCardMetrics::GetName(Operation op)
+{
+    return op < OP_COUNT ? operation_names[op] : "";
+}
+
+uint32_t SDCardMetrics::OperationStats::Percentile(uint32_t percent) const
+{
+    if (calls == 0)
+        return 0;
+
+    // the first bucket that takes the running count to the wanted share of calls
+    uint64_t wanted = ((uint64_t)calls * percent + 99) / 100;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < bucket_count; i++)
+    {
+        seen += buckets[i];
+        if (seen >= wanted && seen)
+        {
+            uint32_t upper = i == 0 ? 0 : (1u << i) - 1;
+            return i + 1 == bucket_count || upper > max_us ? max_us : upper;
+        }
+    }
+    return max_us;
+}
+
+void SDCardMetrics::Dump(const Data& data, LineWriter writer, void* user_data)
+{
+    char line[160];
+    writer("name calls bytes p50_us p99_us max_us avg_us sectors_read sectors_written seeks\n", user_data);
+    for (size_t i = 0; i < OP_COUNT; i++)
+    {
+        const OperationStats& stats = data.operations[i];
+        if (stats.calls == 0)
+            continue;
+
+        snprintf(line, sizeof(line), "%s %lu %llu %lu %lu %lu %lu %lu %lu %lu\n", operation_names[i],
+            (unsigned long)stats.calls, (unsigned long long)stats.bytes,
+            (unsigned long)stats.Percentile(50), (unsigned long)stats.Percentile(99), (unsigned long)stats.max_us,
+            (unsigned long)(stats.total_us / stats.calls),
+            (unsigned long)stats.sectors_read, (unsigned long)stats.sectors_written, (unsigned long)stats.seeks);
+        writer(line, user_data);
+    }
+
+    snprintf(line, sizeof(line), "total read_commands %lu sectors_read %lu write_commands %lu sectors_written %lu sync_commands %lu seeks %lu\n",
+        (unsigned long)data.read_commands, (unsigned long)data.sectors_read,
+        (unsigned long)data.write_commands, (unsigned long)data.sectors_written,
+        (unsigned long)data.sync_commands, (unsigned long)data.seeks);
+    writer(line, user_data);
+}
+
+#if PICO_SD_METRICS
+SDCardMetrics::Scope::Scope(SDCardMetrics& metrics, Operation op)
+    : metrics(metrics), op(op), start(NowUs()), sectors_read(metrics.data.sectors_read),
+    sectors_written(metrics.data.sectors_written), seeks(metrics.data.seeks)
+{
+}
+
+SDCardMetrics::Scope::~Scope()
+{
+    uint32_t elapsed = NowUs() - start;
+    OperationStats& stats = metrics.data.operations[op];
+    stats.calls++;
+    stats.total_us += elapsed;
+    if (elapsed > stats.max_us)
+        stats.max_us = elapsed;
+    stats.bytes += bytes;
+    stats.sectors_read += metrics.data.sectors_read - sectors_read;
+    stats.sectors_written += metrics.data.sectors_written - sectors_written;
+    stats.seeks += metrics.data.seeks - seeks;
+
+    size_t bucket = elapsed ? 32 - __builtin_clz(elapsed) : 0;
+    stats.buckets[bucket < bucket_count ? bucket : bucket_count - 1]++;
+}
+
+void SDCardMetrics::Dump(LineWriter writer, void* user_data) const
+{
+    Dump(data, writer, user_data);
+}
+#else
+void SDCardMetrics::Dump(LineWriter writer, void* user_data) const
+{
+    static const Data empty = {};
+    Dump(empty, writer, user_data);
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,346 @@
+#include <storage/SDCardNameIndex.h>
+
+#include <string.h>
+
+static inline char FoldCase(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+static inline bool IsSeparator(char c)
+{
+    return c == '/' || c == '\\';
+}
+
+uint32_t SDCardNameIndex::Hash(const char* name)
+{
+    // FNV-1a of the folded name, kept clear of the two marker values
+    uint32_t hash = 2166136261u;
+    for (; *name; name++)
+        hash = (hash ^ (uint8_t)FoldCase(*name)) * 16777619u;
+    return hash > removed_hash ? hash : hash + 2;
+}
+
+bool SDCardNameIndex::NamesEqual(const char* a, const char* b)
+{
+    for (; *a && FoldCase(*a) == FoldCase(*b); a++, b++);
+    return *a == *b;
+}
+
+bool SDCardNameIndex::IsIndexable(const char* name)
+{
+    size_t length = strlen(name);
+    if (length == 0 || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return false;
+    if (name[length - 1] == '.' || name[length - 1] == ' ')
+        return false; // FatFs strips these
+
+    for (size_t i = 0; i < length; i++)
+    {
+        if ((uint8_t)name[i] >= 0x80 || name[i] == '~' || name[i] == '*' || name[i] == '?')
+            return false;
+    }
+    return true;
+}
+
+bool SDCardNameIndex::Enable(const char* dir_path)
+{
+    // "dir/" is "dir", but "/" and "0:/" stay the root
+    size_t length = strlen(dir_path);
+    while (length > 1 && (dir_path[length - 1] == '/' || dir_path[length - 1] == '\\') && dir_path[length - 2] != ':')
+        length--;
+    if (length >= path_length)
+        return false;
+
+    memcpy(path, dir_path, length);
+    path[length] = '\0';
+    enabled = true;
+    built = false;
+    return true;
+}
+
+void SDCardNameIndex::Disable()
+{
+    enabled = false;
+    built = false;
+    hashes.reset();
+    entries.reset();
+    clusters.reset();
+    capacity = 0;
+    used = 0;
+    cluster_count = 0;
+}
+
+const char* SDCardNameIndex::SkipParts(const char* path, size_t path_length, const char* prefix, size_t prefix_length)
+{
+    const char* path_end = path + path_length;
+    const char* prefix_end = prefix + prefix_length;
+    while (prefix < prefix_end)
+    {
+        if (path == path_end)
+            return nullptr;
+
+        if (IsSeparator(*prefix))
+        {
+            if (!IsSeparator(*path))
+                return nullptr;
+            while (prefix < prefix_end && IsSeparator(*prefix))
+                prefix++;
+            while (path < path_end && IsSeparator(*path))
+                path++;
+        }
+        else if (FoldCase(*path++) != FoldCase(*prefix++))
+            return nullptr;
+    }
+
+    // "log" does not start "logs", but the root starts everything
+    if (prefix_length && path != path_end && !IsSeparator(*path) && !IsSeparator(path[-1]))
+        return nullptr;
+    return path;
+}
+
+void SDCardNameIndex::Grow(size_t new_capacity)
+{
+    std::unique_ptr<uint32_t[]> old_hashes = std::move(hashes);
+    std::unique_ptr<uint16_t[]> old_entries = std::move(entries);
+    size_t old_capacity = capacity;
+
+    hashes = std::make_unique<uint32_t[]>(new_capacity);
+    entries = std::make_unique<uint16_t[]>(new_capacity);
+    memset(hashes.get(), 0, new_capacity * sizeof(uint32_t));
+    capacity = new_capacity;
+    used = 0;
+
+    // removed slots stay behind
+    for (size_t i = 0; i < old_capacity; i++)
+    {
+        if (old_hashes[i] > removed_hash)
+            Insert(old_hashes[i], old_entries[i]);
+    }
+}
+
+void SDCardNameIndex::Insert(uint32_t hash, uint16_t entry)
+{
+    if ((used + 1) * 4 > capacity * 3)
+        Grow(capacity ? capacity * 2 : min_capacity);
+
+    size_t i = hash % capacity;
+    while (hashes[i] != empty_hash)
+        i = i + 1 == capacity ? 0 : i + 1;
+
+    hashes[i] = hash;
+    entries[i] = entry;
+    used++;
+}
+
+void SDCardNameIndex::AddCluster(DWORD position, DWORD cluster)
+{
+    size_t index = position / cluster_bytes;
+    if (index >= cluster_count)
+    {
+        size_t new_count = cluster_count ? cluster_count : 4;
+        while (new_count <= index)
+            new_count *= 2;
+
+        std::unique_ptr<DWORD[]> grown = std::make_unique<DWORD[]>(new_count);
+        memset(grown.get(), 0, new_count * sizeof(DWORD));
+        if (cluster_count)
+            memcpy(grown.get(), clusters.get(), cluster_count * sizeof(DWORD));
+        clusters = std::move(grown);
+        cluster_count = new_count;
+    }
+    clusters[index] = cluster;
+}
+
+bool SDCardNameIndex::Build()
+{
+    DIR dir = {};
+    if (f_opendir(&dir, path) != FR_OK)
+        return false;
+
+    FATFS* fs = dir.obj.fs;
+#if FF_FS_EXFAT
+    if (fs->fs_type == FS_EXFAT)
+    {
+        // entry sets are read differently there, positioning a DIR by hand is not worth it
+        f_closedir(&dir);
+        return false;
+    }
+#endif
+
+    if (capacity)
+        memset(hashes.get(), 0, capacity * sizeof(uint32_t));
+    else
+        Grow(min_capacity); // lookups need a table even for an empty directory
+    if (cluster_count)
+        memset(clusters.get(), 0, cluster_count * sizeof(DWORD));
+    used = 0;
+    fallbacks = 0;
+    cluster_bytes = (DWORD)fs->csize * FF_MIN_SS;
+    static_root = dir.clust == 0;
+    counters.builds++;
+
+    FILINFO info;
+    bool result = true;
+    while (1)
+    {
+        // f_readdir may skip free slots before the entry, which a later create can fill,
+        // so the entry's own first slot is what gets stored, not where the read started
+        DWORD start = dir.dptr;
+        DWORD start_cluster = dir.clust;
+        if (f_readdir(&dir, &info) != FR_OK)
+        {
+            result = false;
+            break;
+        }
+        if (info.fname[0] == 0)
+            break;
+
+        // the read stops after the short entry, or on it when the directory ends there
+        DWORD position = dir.sect ? dir.dptr - 32 : dir.dptr;
+#if FF_USE_LFN
+        if (dir.blk_ofs != 0xFFFFFFFF)
+            position = dir.blk_ofs; // the first long name entry
+#endif
+        if (!static_root)
+        {
+            // clusters the read only passed through stay unknown, their entries go to FatFs
+            AddCluster(start, start_cluster);
+            if (dir.sect)
+                AddCluster(dir.dptr, dir.clust);
+        }
+        DWORD entry = position / 32;
+        Insert(Hash(info.fname), entry < unknown_entry ? entry : unknown_entry);
+    }
+    f_closedir(&dir);
+    built = result;
+    return result;
+}
+
+bool SDCardNameIndex::ReadAt(uint16_t entry, FILINFO& info) const
+{
+    DIR dir = {};
+    if (f_opendir(&dir, path) != FR_OK)
+        return false;
+
+    // what dir_sdi would have set for this offset
+    FATFS* fs = dir.obj.fs;
+    DWORD position = (DWORD)entry * 32;
+    bool result = true;
+    if (static_root)
+        dir.sect = fs->dirbase + position / FF_MIN_SS;
+    else
+    {
+        size_t index = position / cluster_bytes;
+        if (index >= cluster_count || clusters[index] < 2)
+            result = false;
+        else
+        {
+            dir.clust = clusters[index];
+            dir.sect = fs->database + (LBA_t)fs->csize * (dir.clust - 2) + position % cluster_bytes / FF_MIN_SS;
+        }
+    }
+
+    if (result)
+    {
+        dir.dptr = position;
+        dir.dir = fs->win + position % FF_MIN_SS;
+        result = f_readdir(&dir, &info) == FR_OK && info.fname[0] != 0;
+    }
+    f_closedir(&dir);
+    return result;
+}
+
+bool SDCardNameIndex::Usable()
+{
+    return enabled && (built || Build());
+}
+
+SDCardNameIndex::Result SDCardNameIndex::Lookup(const char* name, FILINFO& info)
+{
+    if (!Usable())
+        return Result::UNKNOWN;
+
+    // An entry created since the last build, a read that fails or another name where this
+    // one was all leave the answer to FatFs. Only a name that is nowhere in the table is absent.
+    uint32_t hash = Hash(name);
+    bool uncertain = false;
+    for (size_t i = hash % capacity; hashes[i] != empty_hash; i = i + 1 == capacity ? 0 : i + 1)
+    {
+        if (hashes[i] != hash)
+            continue;
+
+        if (entries[i] != unknown_entry && ReadAt(entries[i], info) && NamesEqual(info.fname, name))
+        {
+            counters.found++;
+            return Result::FOUND;
+        }
+        uncertain = true;
+    }
+
+    if (!uncertain)
+    {
+        counters.absent++;
+        return Result::ABSENT;
+    }
+
+    // rebuilding costs a scan of the directory, so only after as many scans were paid for
+    counters.unknown++;
+    if (++fallbacks >= fallbacks_to_rebuild)
+        built = false;
+    return Result::UNKNOWN;
+}
+
+bool SDCardNameIndex::MayContain(const char* name)
+{
+    if (!Usable())
+        return true;
+
+    uint32_t hash = Hash(name);
+    for (size_t i = hash % capacity; hashes[i] != empty_hash; i = i + 1 == capacity ? 0 : i + 1)
+    {
+        if (hashes[i] == hash)
+            return true;
+    }
+    counters.absent++;
+    return false;
+}
+
+void SDCardNameIndex::Added(const char* name)
+{
+    if (!built)
+        return;
+
+    // already there under this name, as when an existing file was opened for writing
+    FILINFO info;
+    uint32_t hash = Hash(name);
+    for (size_t i = hash % capacity; hashes[i] != empty_hash; i = i + 1 == capacity ? 0 : i + 1)
+    {
+        if (hashes[i] == hash && entries[i] != unknown_entry && ReadAt(entries[i], info) && NamesEqual(info.fname, name))
+            return;
+    }
+    Insert(hash, unknown_entry);
+}
+
+void SDCardNameIndex::Removed(const char* name)
+{
+    if (!built)
+        return;
+
+    uint32_t hash = Hash(name);
+    size_t match = capacity;
+    for (size_t i = hash % capacity; hashes[i] != empty_hash; i = i + 1 == capacity ? 0 : i + 1)
+    {
+        if (hashes[i] != hash)
+            continue;
+        if (match != capacity)
+        {
+            built = false; // two names with this hash, cheaper to build again than to tell them apart
+            return;
+        }
+        match = i;
+    }
+
+    if (match != capacity)
+        hashes[match] = removed_hash;
+}
\ No newline at end of file
@@ -0,0 +1,563 @@
+#include <storage/SDCardRecordLog.h>
+
+// CRC-32 (IEEE), a nibble at a time, which keeps the table at 64 bytes.
+static const uint32_t crc_table[16] = {
+    0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+    0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+};
+
+uint32_t SDCardRecordLog::Crc32(const void* data, size_t size, uint32_t crc)
+{
+    const uint8_t* bytes = (const uint8_t*)data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+    {
+        crc = crc_table[(crc ^ bytes[i]) & 0xF] ^ (crc >> 4);
+        crc = crc_table[(crc ^ (bytes[i] >> 4)) & 0xF] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+uint32_t SDCardRecordLog::HeaderCrc(BlockHeader header)
+{
+    header.crc = 0;
+    return Crc32(&header, sizeof(header));
+}
+
+bool SDCardRecordLog::HeaderValid(const BlockHeader& header, uint32_t block)
+{
+    return header.magic == block_magic && header.block == block
+        && header.used <= block_size - sizeof(BlockHeader) && header.crc == HeaderCrc(header);
+}
+
+uint32_t SDCardRecordLog::RecordCrc(const RecordHeader& header, const uint8_t* payload)
+{
+    uint32_t crc = Crc32(&header.key, sizeof(header.key));
+    crc = Crc32(&header.length, sizeof(header.length), crc);
+    return Crc32(payload, header.length, crc);
+}
+
+uint32_t SDCardRecordLog::IndexCrc(const IndexEntry& entry)
+{
+    uint32_t crc = Crc32(&entry.first_key, sizeof(entry.first_key));
+    return Crc32(&entry.block, sizeof(entry.block), crc);
+}
+
+uint64_t SDCardRecordLog::LastKey(const uint8_t* block)
+{
+    BlockHeader header;
+    memcpy(&header, block, sizeof(header));
+
+    uint64_t key = header.first_key;
+    for (uint16_t offset = 0; offset < header.used;)
+    {
+        RecordHeader record;
+        memcpy(&record, block + sizeof(BlockHeader) + offset, sizeof(record));
+        key = record.key;
+        offset += sizeof(RecordHeader) + record.length;
+    }
+    return key;
+}
+
+SDCardRecordLog::SDCardRecordLog(SDCard& card, uint32_t index_interval)
+    : card(&card), index_interval(index_interval ? index_interval : 1)
+{
+}
+
+SDCardRecordLog::~SDCardRecordLog()
+{
+    Close();
+}
+
+SDCardRecordLog::BlockHeader& SDCardRecordLog::WriteHeader()
+{
+    return *(BlockHeader*)write_block;
+}
+
+bool SDCardRecordLog::Initialise(uint64_t size)
+{
+    // zeroed slots hold no block, whatever the clusters held before
+    memset(read_block, 0, block_size);
+    read_block_number = UINT32_MAX;
+    uint64_t offset = size / block_size * block_size;
+    if (offset == 0)
+    {
+        LogHeader header = {log_magic, log_version, block_size, 0};
+        header.crc = Crc32(&header, sizeof(header) - sizeof(header.crc));
+        memcpy(read_block, &header, sizeof(header));
+    }
+
+    if (!card->Seek(data_handle, offset))
+        return false;
+    for (; offset < data_offset; offset += block_size)
+    {
+        if (card->WriteBuffer(data_handle, read_block, block_size) != block_size)
+            return false;
+        memset(read_block, 0, sizeof(LogHeader));
+    }
+    return true;
+}
+
+void SDCardRecordLog::StartBlock(uint32_t number, uint64_t first_key)
+{
+    memset(write_block, 0, block_size);
+    BlockHeader& header = WriteHeader();
+    header.magic = block_magic;
+    header.block = number;
+    header.first_key = first_key;
+    write_block_number = number;
+    write_block_open = true;
+    write_block_dirty = true;
+}
+
+bool SDCardRecordLog::WriteBlock(uint64_t offset)
+{
+    BlockHeader& header = WriteHeader();
+    header.crc = HeaderCrc(header);
+
+    // offset is inside the file or right at its end, so the seek never clamps
+    return card->Seek(data_handle, offset) && card->WriteBuffer(data_handle, write_block, block_size) == block_size;
+}
+
+bool SDCardRecordLog::CloseBlock()
+{
+    if (!WriteBlock(data_offset + (uint64_t)write_block_number * block_size))
+        return false;
+
+    block_count = write_block_number + 1;
+    write_block_open = false;
+    write_block_dirty = false;
+    return true;
+}
+
+bool SDCardRecordLog::WriteTail()
+{
+    // the other slot keeps the copy the last Flush made until this one is on the card
+    if (!WriteBlock((1 + tail_slot) * block_size))
+        return false;
+
+    tail_slot = (tail_slot + 1) % tail_slots;
+    write_block_dirty = false;
+    return true;
+}
+
+SDCardRecordLog::Check SDCardRecordLog::ReadBlock(uint64_t offset, uint32_t number)
+{
+    // the sector lies inside the file, so a short read is the card failing
+    read_block_number = UINT32_MAX;
+    if (!card->Seek(data_handle, offset) || card->ReadBuffer(data_handle, read_block, block_size) != block_size)
+        return Check::READ_FAILED;
+
+    BlockHeader header;
+    memcpy(&header, read_block, sizeof(header));
+    return HeaderValid(header, number) ? Check::VALID : Check::DAMAGED;
+}
+
+const uint8_t* SDCardRecordLog::LoadBlock(uint32_t number)
+{
+    const uint8_t* block;
+    return CheckBlock(number, block) == Check::VALID ? block : nullptr;
+}
+
+SDCardRecordLog::Check SDCardRecordLog::CheckBlock(uint32_t number, const uint8_t*& block)
+{
+    block = nullptr;
+    if (write_block_open && number == write_block_number)
+    {
+        block = write_block;
+        return Check::VALID;
+    }
+    if (number >= block_count)
+        return Check::DAMAGED;
+    if (number == read_block_number)
+    {
+        block = read_block;
+        return Check::VALID;
+    }
+
+    Check check = ReadBlock(data_offset + (uint64_t)number * block_size, number);
+    if (check != Check::VALID)
+        return check;
+
+    read_block_number = number;
+    block = read_block;
+    return Check::VALID;
+}
+
+bool SDCardRecordLog::ReadIndex(uint32_t entry, IndexEntry& out)
+{
+    return CheckIndex(entry, out) == Check::VALID;
+}
+
+SDCardRecordLog::Check SDCardRecordLog::CheckIndex(uint32_t entry, IndexEntry& out)
+{
+    if (!card->Seek(index_handle, (uint64_t)entry * sizeof(IndexEntry))
+        || card->ReadBuffer(index_handle, &out, sizeof(out)) != sizeof(out))
+        return Check::READ_FAILED;
+    return out.crc == IndexCrc(out) ? Check::VALID : Check::DAMAGED;
+}
+
+bool SDCardRecordLog::AppendIndex(uint64_t first_key, uint32_t block)
+{
+    IndexEntry entry = {first_key, block, 0};
+    entry.crc = IndexCrc(entry);
+    if (!card->Seek(index_handle, (uint64_t)index_entries * sizeof(IndexEntry))
+        || card->WriteBuffer(index_handle, &entry, sizeof(entry)) != sizeof(entry))
+        return false;
+    index_entries++;
+    return true;
+}
+
+uint16_t SDCardRecordLog::ValidRecordBytes(const uint8_t* block, uint16_t& count)
+{
+    BlockHeader header;
+    memcpy(&header, block, sizeof(header));
+
+    uint16_t offset = 0;
+    count = 0;
+    while (offset + sizeof(RecordHeader) <= header.used)
+    {
+        RecordHeader record;
+        memcpy(&record, block + sizeof(BlockHeader) + offset, sizeof(record));
+        const uint8_t* payload = block + sizeof(BlockHeader) + offset + sizeof(RecordHeader);
+        if (offset + sizeof(RecordHeader) + record.length > header.used || record.crc != RecordCrc(record, payload))
+            break;
+        offset += sizeof(RecordHeader) + record.length;
+        count++;
+    }
+    return offset;
+}
+
+bool SDCardRecordLog::Recover()
+{
+    recovery = {};
+    FIL& data = card->file_slots[data_handle].file;
+    FIL& index = card->file_slots[index_handle].file;
+    uint64_t size = f_size(&data);
+
+    block_count = 0;
+    write_block_number = 0;
+    write_block_open = false;
+    write_block_dirty = false;
+    read_block_number = UINT32_MAX;
+    tail_slot = 0;
+
+    // Anything that does not start with the header of a log is somebody else's file, not a torn log.
+    if (size)
+    {
+        LogHeader header;
+        if (!card->Seek(data_handle, 0) || card->ReadBuffer(data_handle, &header, sizeof(header)) != sizeof(header))
+            return false;
+        if (header.magic != log_magic || header.version != log_version || header.block_size != block_size
+            || header.crc != Crc32(&header, sizeof(header) - sizeof(header.crc)))
+            return false;
+    }
+    if (size < data_offset && !Initialise(size))
+        return false;
+
+    // Full blocks are written once, so only the last ones can be torn, by a power loss before
+    // they were synced. Blocks that were read and found wrong are cut off, a failed read fails
+    // the recovery.
+    uint32_t blocks = size > data_offset ? (size - data_offset) / block_size : 0;
+    block_count = blocks;
+    const uint8_t* block;
+    while (blocks)
+    {
+        recovery.blocks_checked++;
+        Check check = CheckBlock(blocks - 1, block);
+        if (check == Check::READ_FAILED)
+            return false;
+        if (check == Check::VALID)
+            break;
+        blocks--;
+        recovery.blocks_dropped++;
+    }
+
+    if (size > data_offset && data_offset + (uint64_t)blocks * block_size != size)
+    {
+        if (f_lseek(&data, data_offset + (uint64_t)blocks * block_size) != FR_OK || f_truncate(&data) != FR_OK)
+            return false;
+    }
+    block_count = blocks;
+
+    has_records = blocks > 0;
+    last_key = 0;
+    if (blocks)
+    {
+        if (!(block = LoadBlock(blocks - 1)))
+            return false;
+        last_key = LastKey(block);
+    }
+
+    // The open block is the one after the full ones, in whichever tail slot holds more of it.
+    // A slot with another block is left over from a block that filled up since, or torn.
+    uint16_t best = 0;
+    for (uint8_t slot = 0; slot < tail_slots; slot++)
+    {
+        Check check = ReadBlock((1 + slot) * block_size, blocks);
+        if (check == Check::READ_FAILED)
+            return false;
+
+        uint16_t count;
+        uint16_t valid = check == Check::VALID ? ValidRecordBytes(read_block, count) : 0;
+        if (check == Check::VALID && (!write_block_open || valid > best))
+        {
+            memcpy(write_block, read_block, block_size);
+            write_block_number = blocks;
+            write_block_open = true;
+            tail_slot = (slot + 1) % tail_slots;
+            best = valid;
+        }
+    }
+    read_block_number = UINT32_MAX;
+
+    if (write_block_open)
+    {
+        // minus any records that do not check out
+        BlockHeader& header = WriteHeader();
+        uint16_t count;
+        uint16_t valid = ValidRecordBytes(write_block, count);
+        if (valid != header.used)
+        {
+            memset(write_block + sizeof(BlockHeader) + valid, 0, header.used - valid);
+            recovery.records_dropped = header.record_count > count ? header.record_count - count : 0;
+            header.used = valid;
+            header.record_count = count;
+            write_block_dirty = true;
+        }
+
+        if (header.record_count)
+        {
+            last_key = LastKey(write_block);
+            has_records = true;
+        }
+    }
+    else
+    {
+        write_block_number = blocks;
+    }
+
+    // Drop index entries that are torn or point past the data, then add the ones missing.
+    index_entries = f_size(&index) / sizeof(IndexEntry);
+    IndexEntry entry;
+    while (index_entries)
+    {
+        Check check = CheckIndex(index_entries - 1, entry);
+        if (check == Check::READ_FAILED)
+            return false;
+        if (check == Check::VALID && entry.block < GetBlockCount())
+            break;
+        index_entries--;
+    }
+    if (f_lseek(&index, (uint64_t)index_entries * sizeof(IndexEntry)) != FR_OK || f_truncate(&index) != FR_OK)
+        return false;
+
+    blocks = GetBlockCount();
+    uint32_t expected = blocks ? (blocks - 1) / index_interval + 1 : 0;
+    for (uint32_t i = index_entries; i < expected; i++)
+    {
+        uint32_t block = i * index_interval;
+        const uint8_t* loaded = LoadBlock(block);
+        if (!loaded)
+            return false;
+
+        BlockHeader header;
+        memcpy(&header, loaded, sizeof(header));
+        if (!AppendIndex(header.first_key, block))
+            return false;
+        recovery.index_entries_rebuilt++;
+    }
+
+    cursor_block = 0;
+    cursor_offset = 0;
+    return !write_block_dirty || WriteTail();
+}
+
+bool SDCardRecordLog::Open(const char* path)
+{
+    size_t length = strlen(path);
+    if (IsOpen() || length > max_path_length)
+        return false;
+
+    memcpy(data_path, path, length);
+    memcpy(index_path, path, length);
+    memcpy(index_path + length, ".idx", 5);
+    data_path[length] = '\0';
+
+    uint32_t access = StorageDevice::READ | StorageDevice::WRITE | StorageDevice::OPEN_OVERWRITE;
+    data_handle = card->OpenHandle(data_path, access);
+    if (data_handle == SDCard::invalid_handle)
+        return false;
+
+    index_handle = card->OpenHandle(index_path, access);
+    if (index_handle == SDCard::invalid_handle || !Recover())
+    {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+bool SDCardRecordLog::Close()
+{
+    if (!IsOpen())
+        return false;
+
+    bool result = index_handle != SDCard::invalid_handle && Flush();
+    result = card->CloseHandle(data_handle) && result;
+    if (index_handle != SDCard::invalid_handle)
+        result = card->CloseHandle(index_handle) && result;
+
+    data_handle = SDCard::invalid_handle;
+    index_handle = SDCard::invalid_handle;
+    return result;
+}
+
+bool SDCardRecordLog::Append(uint64_t key, const void* data, uint16_t length)
+{
+    if (!IsOpen() || length > max_record_size || (has_records && key < last_key))
+        return false;
+
+    // a block that filled up goes to its place even when a tail slot already holds all of it
+    if (write_block_open && WriteHeader().used + sizeof(RecordHeader) + length > block_size - sizeof(BlockHeader)
+        && !CloseBlock())
+        return false;
+
+    if (!write_block_open)
+    {
+        uint32_t number = block_count;
+        StartBlock(number, key);
+        if (number % index_interval == 0 && !AppendIndex(key, number))
+            return false;
+    }
+
+    BlockHeader& header = WriteHeader();
+    if (header.record_count == 0)
+        header.first_key = key;
+
+    RecordHeader record = {key, 0, length, 0};
+    uint8_t* dest = write_block + sizeof(BlockHeader) + header.used;
+    memcpy(dest + sizeof(RecordHeader), data, length);
+    record.crc = RecordCrc(record, dest + sizeof(RecordHeader));
+    memcpy(dest, &record, sizeof(record));
+
+    header.used += sizeof(RecordHeader) + length;
+    header.record_count++;
+    write_block_dirty = true;
+    last_key = key;
+    has_records = true;
+    return true;
+}
+
+bool SDCardRecordLog::Flush()
+{
+    if (!IsOpen())
+        return false;
+
+    bool result = !write_block_dirty || WriteTail();
+    // the index last, an entry may only point at data that is already on the card
+    result = card->Flush(data_handle) && result;
+    return card->Flush(index_handle) && result;
+}
+
+bool SDCardRecordLog::SeekStart()
+{
+    if (!IsOpen())
+        return false;
+
+    cursor_block = 0;
+    cursor_offset = 0;
+    return true;
+}
+
+bool SDCardRecordLog::Seek(uint64_t key)
+{
+    if (!SeekStart())
+        return false;
+
+    // The last indexed block that starts below key, then the last block in its run that does.
+    // Blocks starting at key exactly may follow records equal to key in the block before.
+    uint32_t low = 0;
+    uint32_t high = index_entries;
+    IndexEntry entry;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        if (!ReadIndex(mid, entry))
+            return false;
+        if (entry.first_key < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    uint32_t first_block = low ? (low - 1) * index_interval : 0;
+    uint32_t end_block = low < index_entries ? low * index_interval : GetBlockCount();
+
+    low = first_block + 1;
+    high = end_block;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low) / 2;
+        const uint8_t* block = LoadBlock(mid);
+        if (!block)
+            return false;
+
+        BlockHeader header;
+        memcpy(&header, block, sizeof(header));
+        if (header.first_key < key)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    // then along the records, at most one block's worth
+    cursor_block = low - 1;
+    while (const uint8_t* block = LoadBlock(cursor_block))
+    {
+        BlockHeader header;
+        memcpy(&header, block, sizeof(header));
+        while (cursor_offset < header.used)
+        {
+            RecordHeader record;
+            memcpy(&record, block + sizeof(BlockHeader) + cursor_offset, sizeof(record));
+            if (record.key >= key)
+                return true;
+            cursor_offset += sizeof(RecordHeader) + record.length;
+        }
+        cursor_block++;
+        cursor_offset = 0;
+    }
+    return true; // past the end, Next returns false
+}
+
+bool SDCardRecordLog::Next(uint64_t& key, void* buffer, size_t buffer_size, uint16_t& length)
+{
+    if (!IsOpen())
+        return false;
+
+    while (const uint8_t* block = LoadBlock(cursor_block))
+    {
+        BlockHeader header;
+        memcpy(&header, block, sizeof(header));
+        if (cursor_offset + sizeof(RecordHeader) <= header.used)
+        {
+            RecordHeader record;
+            const uint8_t* at = block + sizeof(BlockHeader) + cursor_offset;
+            memcpy(&record, at, sizeof(record));
+            if (cursor_offset + sizeof(RecordHeader) + record.length <= header.used
+                && record.crc == RecordCrc(record, at + sizeof(RecordHeader)))
+            {
+                key = record.key;
+                length = record.length;
+                memcpy(buffer, at + sizeof(RecordHeader), record.length < buffer_size ? record.length : buffer_size);
+                cursor_offset += sizeof(RecordHeader) + record.length;
+                return true;
+            }
+            // a damaged record makes the rest of its block unreadable, carry on with the next one
+        }
+        cursor_block++;
+        cursor_offset = 0;
+    }
+    return false;
+}
\ No newline at end of file
@@ -13,6 +13,9 @@ SDCardSDIO::SDCardSDIO(const SDCardSDIO::Pinout& pins, const char* pc_name)
 
     card.type = SD_IF_SDIO;
     card.sdio_if_p = &card_interface;
+    // The driver sets the PIO clock divider when it initialises the card and offers no way
+    // to change it afterwards, so the clock stays at baud_rate and the policy only counts.
+    SetClockConfig({baud_rate, baud_rate, baud_rate, 0, 3, 1000});
 }
 
 SDCardSDIO::SDCardSDIO(uint8_t cmd_pin, uint8_t d0_pin, const char* pc_name)
@@ -14,6 +14,7 @@ SDCardSPI::SDCardSPI(const SDCardSPI::Pinout& pins, spi_inst_t* spi_inst, const
     
     card.type = SD_IF_SPI;
     card.spi_if_p = &card_interface;
+    ConfigureClock();
 }
 
 SDCardSPI::SDCardSPI(uint8_t clk_pin, uint8_t mosi_pin, uint8_t miso_pin, uint8_t cs_pin, spi_inst_t* spi_inst, const char* pc_name)
@@ -30,4 +31,22 @@ SDCardSPI::SDCardSPI(uint8_t clk_pin, uint8_t mosi_pin, uint8_t miso_pin, uint8_
     
     card.type = SD_IF_SPI;
     card.spi_if_p = &card_interface;
+    ConfigureClock();
+}
+
+void SDCardSPI::ConfigureClock()
+{
+    // The peripheral divides clk_peri by even numbers only, so each step is one divider:
+    // a clean run moves up from start_baud_rate to baud_rate, errors move back down.
+    SetClockConfig({min_baud_rate, start_baud_rate, baud_rate, baud_rate - start_baud_rate, 3, 1000});
+}
+
+bool SDCardSPI::SetBusClock(uint32_t hz)
+{
+    spi.baud_rate = hz; // the driver switches to it after the slow identification phase of the next init
+    if (card.state.m_Status & STA_NOINIT)
+        return false;
+
+    spi_set_baudrate(spi.hw_inst, hz);
+    return true;
 }
\ No newline at end of file
@@ -0,0 +1,319 @@
+#include <storage/SDCardSectorCache.h>
+
+#ifdef PICO_SD_HOST
+#include <mutex>
+
+static std::recursive_mutex cache_mutex;
+#else
+#include <pico/mutex.h>
+
+auto_init_recursive_mutex(cache_mutex);
+#endif
+
+// Held for the bookkeeping and single-sector transfers, while bulk transfers run outside it.
+struct SectorCacheLock
+{
+    SectorCacheLock()
+    {
+#ifdef PICO_SD_HOST
+        cache_mutex.lock();
+#else
+        recursive_mutex_enter_blocking(&cache_mutex);
+#endif
+    }
+
+    ~SectorCacheLock()
+    {
+#ifdef PICO_SD_HOST
+        cache_mutex.unlock();
+#else
+        recursive_mutex_exit(&cache_mutex);
+#endif
+    }
+};
+
+SDCardSectorCache::Entry SDCardSectorCache::entries[size ? size : 1];
+uint32_t SDCardSectorCache::clock = 0;
+SDCardSectorCache::Policy SDCardSectorCache::policy = SDCardSectorCache::Policy::WRITE_THROUGH;
+SDCardSectorCache::Statistics SDCardSectorCache::stats = {};
+
+SDCard* SDCardSectorCache::Owner(sd_card_t* sd_card_p)
+{
+    return SDCard::GetByCard(sd_card_p);
+}
+
+SDCardSectorCache::Entry* SDCardSectorCache::Find(sd_card_t* sd_card_p, uint64_t sector)
+{
+    for (size_t i = 0; i < size; i++)
+    {
+        if (entries[i].valid && entries[i].card == sd_card_p && entries[i].sector == sector)
+            return &entries[i];
+    }
+    return nullptr;
+}
+
+SDCardSectorCache::Entry* SDCardSectorCache::Allocate(SDCard* owner, uint64_t sector)
+{
+    // An empty entry if there is one, otherwise the least recently used,
+    // where a FAT sector counts as used size * 4 accesses later than it was.
+    Entry* victim = nullptr;
+    uint32_t victim_age = 0;
+    for (size_t i = 0; i < size; i++)
+    {
+        Entry& entry = entries[i];
+        if (!entry.valid)
+        {
+            victim = &entry;
+            break;
+        }
+
+        // writing it back would mean using another card's bus, which may be busy on the other core
+        if (entry.dirty && entry.card != &owner->card)
+            continue;
+
+        uint32_t age = clock - entry.last_used;
+        uint32_t bonus = entry.is_fat ? size * 4 : 0;
+        age = age > bonus ? age - bonus : 0;
+        if (!victim || age > victim_age)
+        {
+            victim = &entry;
+            victim_age = age;
+        }
+    }
+
+    if (!victim)
+        return nullptr;
+
+    if (victim->valid)
+    {
+        if (victim->dirty && !WriteBack(*victim))
+            return nullptr;
+        stats.evictions++;
+    }
+
+    const FATFS& fs = owner->fs;
+    victim->card = &owner->card;
+    victim->sector = sector;
+    victim->valid = true;
+    victim->dirty = false;
+    victim->is_fat = fs.fs_type && sector < fs.database;
+    victim->last_used = ++clock;
+    return victim;
+}
+
+bool SDCardSectorCache::WriteBack(Entry& entry)
+{
+    SDCard* owner = Owner(entry.card);
+    if (!owner || owner->raw_block_layer.write_blocks(entry.card, entry.data, entry.sector, 1) != SD_BLOCK_DEVICE_ERROR_NONE)
+        return false;
+
+    entry.dirty = false;
+    stats.write_backs++;
+    return true;
+}
+
+block_dev_err_t SDCardSectorCache::ReadBlocks(sd_card_t* sd_card_p, uint8_t* buffer, uint64_t sector, uint32_t count)
+{
+    SDCard* owner = Owner(sd_card_p);
+    if (!owner)
+        return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
+
+    if (count == 1)
+    {
+        SectorCacheLock lock;
+        Entry* entry = Find(sd_card_p, sector);
+        if (entry)
+        {
+            stats.hits++;
+            entry->last_used = ++clock;
+            memcpy(buffer, entry->data, FF_MIN_SS);
+            return SD_BLOCK_DEVICE_ERROR_NONE;
+        }
+
+        stats.misses++;
+        entry = Allocate(owner, sector);
+        if (entry)
+        {
+            block_dev_err_t result = owner->raw_block_layer.read_blocks(sd_card_p, entry->data, sector, 1);
+            if (result != SD_BLOCK_DEVICE_ERROR_NONE)
+            {
+                entry->valid = false;
+                return result;
+            }
+            memcpy(buffer, entry->data, FF_MIN_SS);
+            return SD_BLOCK_DEVICE_ERROR_NONE;
+        }
+    }
+
+    block_dev_err_t result = owner->raw_block_layer.read_blocks(sd_card_p, buffer, sector, count);
+    if (result != SD_BLOCK_DEVICE_ERROR_NONE)
+        return result;
+
+    // the card is behind on anything still dirty here
+    SectorCacheLock lock;
+    stats.bypassed++;
+    for (size_t i = 0; i < size; i++)
+    {
+        Entry& entry = entries[i];
+        if (entry.valid && entry.dirty && entry.card == sd_card_p && entry.sector >= sector && entry.sector < sector + count)
+            memcpy(buffer + (entry.sector - sector) * FF_MIN_SS, entry.data, FF_MIN_SS);
+    }
+    return SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+block_dev_err_t SDCardSectorCache::WriteBlocks(sd_card_t* sd_card_p, const uint8_t* buffer, uint64_t sector, uint32_t count)
+{
+    SDCard* owner = Owner(sd_card_p);
+    if (!owner)
+        return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
+
+    if (count == 1)
+    {
+        SectorCacheLock lock;
+        Entry* entry = Find(sd_card_p, sector);
+        if (!entry)
+            entry = Allocate(owner, sector);
+        if (entry)
+        {
+            memcpy(entry->data, buffer, FF_MIN_SS);
+            entry->last_used = ++clock;
+            if (policy == Policy::WRITE_BACK || owner->writes_held)
+            {
+                entry->dirty = true;
+                return SD_BLOCK_DEVICE_ERROR_NONE;
+            }
+
+            block_dev_err_t result = owner->raw_block_layer.write_blocks(sd_card_p, buffer, sector, 1);
+            entry->dirty = false;
+            entry->valid = result == SD_BLOCK_DEVICE_ERROR_NONE;
+            return result;
+        }
+    }
+
+    block_dev_err_t result = owner->raw_block_layer.write_blocks(sd_card_p, buffer, sector, count);
+
+    // Cached copies of the range take the new data if it made it to the card.
+    // Otherwise the clean ones are dropped and the dirty ones keep waiting for write-back.
+    SectorCacheLock lock;
+    stats.bypassed++;
+    for (size_t i = 0; i < size; i++)
+    {
+        Entry& entry = entries[i];
+        if (!entry.valid || entry.card != sd_card_p || entry.sector < sector || entry.sector >= sector + count)
+            continue;
+
+        if (result == SD_BLOCK_DEVICE_ERROR_NONE)
+        {
+            memcpy(entry.data, buffer + (entry.sector - sector) * FF_MIN_SS, FF_MIN_SS);
+            entry.dirty = false;
+        }
+        else if (!entry.dirty)
+        {
+            entry.valid = false;
+        }
+    }
+    return result;
+}
+
+block_dev_err_t SDCardSectorCache::Sync(sd_card_t* sd_card_p)
+{
+    SDCard* owner = Owner(sd_card_p);
+    if (!owner)
+        return SD_BLOCK_DEVICE_ERROR_NO_RESPONSE;
+    if (owner->writes_held)
+        return SD_BLOCK_DEVICE_ERROR_NONE;
+
+    if (!Flush(owner))
+        return SD_BLOCK_DEVICE_ERROR_WRITE;
+    return owner->raw_block_layer.sync(sd_card_p);
+}
+
+void SDCardSectorCache::Attach(SDCard* card)
+{
+    // nothing to sit in front of if the driver has not filled in the block layer
+    if (size == 0 || !card->card.read_blocks || card->card.read_blocks == &ReadBlocks)
+        return;
+
+    card->raw_block_layer.read_blocks = card->card.read_blocks;
+    card->raw_block_layer.write_blocks = card->card.write_blocks;
+    card->raw_block_layer.sync = card->card.sync;
+    card->card.read_blocks = &ReadBlocks;
+    card->card.write_blocks = &WriteBlocks;
+    card->card.sync = &Sync;
+}
+
+void SDCardSectorCache::Detach(SDCard* card)
+{
+    if (card->card.read_blocks != &ReadBlocks)
+        return;
+
+    SectorCacheLock lock;
+    Flush(card);
+    Invalidate(card);
+    card->card.read_blocks = card->raw_block_layer.read_blocks;
+    card->card.write_blocks = card->raw_block_layer.write_blocks;
+    card->card.sync = card->raw_block_layer.sync;
+}
+
+bool SDCardSectorCache::Flush(SDCard* card)
+{
+    // in ascending sector order, so neighbouring sectors go out back to back
+    SectorCacheLock lock;
+    bool result = true;
+    bool tried[size ? size : 1] = {};
+    while (true)
+    {
+        size_t next = size;
+        for (size_t i = 0; i < size; i++)
+        {
+            Entry& entry = entries[i];
+            if (!tried[i] && entry.valid && entry.dirty && (!card || entry.card == &card->card)
+                && (next == size || entry.sector < entries[next].sector))
+                next = i;
+        }
+
+        if (next == size)
+            return result;
+        tried[next] = true; // a failed one stays dirty for the next flush
+        result = WriteBack(entries[next]) && result;
+    }
+}
+
+void SDCardSectorCache::Invalidate(SDCard* card)
+{
+    SectorCacheLock lock;
+    for (size_t i = 0; i < size; i++)
+    {
+        if (entries[i].card == &card->card)
+            entries[i].valid = false;
+    }
+}
+
+void SDCardSectorCache::HoldWrites(SDCard* card)
+{
+    SectorCacheLock lock;
+    card->writes_held = true;
+}
+
+bool SDCardSectorCache::ReleaseWrites(SDCard* card)
+{
+    SectorCacheLock lock;
+    card->writes_held = false;
+    if (card->card.sync != &Sync)
+        return true; // not in front of the card, so nothing was held
+    return Sync(&card->card) == SD_BLOCK_DEVICE_ERROR_NONE;
+}
+
+bool SDCardSectorCache::SetPolicy(Policy policy)
+{
+    SectorCacheLock lock;
+    bool result = policy == Policy::WRITE_BACK || Flush();
+    SDCardSectorCache::policy = policy;
+    return result;
+}
+
+float SDCardSectorCache::GetHitRate()
+{
+    uint32_t total = stats.hits + stats.misses;
+    return total ? (float)stats.hits / total : 0.0f;
+}
\ No newline at end of file
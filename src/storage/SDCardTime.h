@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+
+#ifdef PICO_SD_HOST
+#include <chrono>
+#else
+#include <hardware/timer.h>
+#endif
+
+// Microseconds on a free-running clock, for spans well short of its 71-minute wrap.
+static inline uint32_t NowUs()
+{
+#ifdef PICO_SD_HOST
+    return (uint32_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+    return time_us_32();
+#endif
+}
\ No newline at end of file